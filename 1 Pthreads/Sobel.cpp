@@ -4,7 +4,15 @@
  * Development platform: g++ (Ubuntu 6.2.0-3ubuntu11~14.04) 6.2.0
  * Last modified date: 29 Jan 2017
  * Compilation: g++ -Wall -std=c++11 -pthread Sobel.cpp -o Sobel
-                ./Sobel <Input image filename> <Output image filename> <Threads#> <Chunk size>
+                  add -DSOBEL_BORDER=BORDER_REPLICATE/BORDER_REFLECT/BORDER_WRAP for gradients on the image border
+                ./Sobel <Input image filename> <Output image filename> <Threads#|auto> <Chunk size|guided|adaptive> [P2/P5] [numa] [replicate] [incremental <state file>]
+                  auto or 0: one thread per hardware thread the process is allowed to run on
+                  guided: every chunk is 1/Threads# of the remaining rows
+                  adaptive: chunk size follows the measured time per row, but never exceeds the guided size
+                  incremental: only recompute tiles whose input changed since the run that wrote the state file
+                  numa: pin threads, give each a static block of chunks and let it first-touch its rows
+                  replicate: with numa, every thread also keeps node-local copies of its two halo rows
+                PERF_PHASES=1 ./Sobel ... prints hardware counters per phase and thread
  */
 
 #include <algorithm>
@@ -16,7 +24,19 @@
 #include <iostream>
 #include <vector>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include "../lib/Sobel.h"
+#include "../lib/Numa.h"
+#include "../lib/Pgm.h"
+#include "../lib/Tiles.h"
+#include "../lib/Perf.h"
 
 /* Global variables, Look at their usage in main() */
 int image_height;
@@ -28,68 +48,250 @@ int num_threads;
 int chunkSize;
 int maxChunk;
 int chunkcnt;
-int maskX[3][3];
-int maskY[3][3];
+int nextRow;
+enum ChunkPolicy { CHUNK_FIXED, CHUNK_GUIDED, CHUNK_ADAPTIVE };
+ChunkPolicy chunkPolicy;
+double rowSeconds;
+/* Adaptive chunks aim at this much work, enough to hide the cost of taking the mutex */
+const double targetChunkSeconds = 200e-6;
+bool binaryOutput;
+bool numaPlacement;
+bool replicateHalo;
+std::vector<int> stagingImage;
+std::vector<std::string> chunkOutput;
 std::mutex chunk_mutex;
+pthread_barrier_t touch_barrier;
+
+#ifndef SOBEL_BORDER
+#define SOBEL_BORDER BORDER_ZERO
+#endif
+const sobel::BorderMode borderMode = sobel::SOBEL_BORDER;
 
 /* **************** functions ***************** */
+/* A global image as a library view, the filter itself lives in lib/Sobel.h */
+sobel::ImageView image_view(int (*image)[1000]){
+    return sobel::view(&image[0][0], image_width, image_height, sizeof(image[0]));
+}
+
+/* Format finished rows [rowBegin, rowEnd) into the buffer of their first row, as P2 text or P5 bytes */
+void format_rows(int rowBegin, int rowEnd){
+    std::string& out = chunkOutput[rowBegin];
+    if(rowBegin >= rowEnd) return;
+    out.resize(pgm::formatted_size(image_width, rowEnd-rowBegin, binaryOutput));
+    out.resize(pgm::format_rows(image_view(outputImage), rowBegin, rowEnd, binaryOutput, &out[0]) - &out[0]);
+}
+
+/* Filter the rectangle of rows [r0, r1) and columns [c0, c1) */
+void sobel_rect(int r0, int r1, int c0, int c1){
+    sobel::sobel_rect<borderMode, int, int>(image_view(inputImage), image_view(outputImage), r0, r1, c0, c1);
+}
+
+/* Rows in the next chunk, called with chunk_mutex held */
+int chunk_rows(int remaining){
+    int guided = (remaining + num_threads - 1)/num_threads;
+    switch(chunkPolicy){
+    case CHUNK_GUIDED:
+        return guided;
+    case CHUNK_ADAPTIVE: {
+        // probe with a small chunk until the first one has been timed
+        int target = rowSeconds > 0 ? (int)(targetChunkSeconds/rowSeconds) : 4;
+        return std::max(1, std::min(target, guided));
+    }
+    default:
+        return std::min(chunkSize, remaining);
+    }
+}
+
 void calcmask(int thread_num){
-    int sumx, sumy, sum;
+    int chunk, rowBegin = 0, rowEnd = 0;
+    double seconds = 0;
     do{
         // lock the mutex and test if there are remaining chunks
         {
             std::lock_guard<std::mutex> lock(chunk_mutex);
-            if (chunkcnt >= maxChunk-1) return;
-            ++chunkcnt;
-            fprintf(stdout, "Thread %d process chunk %d\n", thread_num, chunkcnt);
+            if(seconds > 0){
+                double last = seconds/(rowEnd-rowBegin);
+                rowSeconds = rowSeconds > 0 ? 0.75*rowSeconds + 0.25*last : last;
+            }
+            if (nextRow >= image_height) return;
+            rowBegin = nextRow;
+            rowEnd = nextRow += chunk_rows(image_height - nextRow);
+            chunk = ++chunkcnt;
+            fprintf(stdout, "Thread %d process chunk %d\n", thread_num, chunk);
         }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
         // start masking
-        for(int x = chunkSize*chunkcnt; x < chunkSize*(chunkcnt+1); ++x){
-            for(int y = 0; y < image_width; ++y){
-                sumx = 0;
-                sumy = 0;
-                /* For handling image boundaries */
-                if( x <= 0 || x >= (image_height-1) || y <= 0 || y >= (image_width-1)) sum = 0;
-                else{
-                    /* Gradient calculation*/
-                    for(int i = -1; i <= 1; ++i) {
-                        for(int j = -1; j <= 1; ++j){
-                            sumx += inputImage[x+i][y+j] * maskX[i+1][j+1];
-                            sumy += inputImage[x+i][y+j] * maskY[i+1][j+1];
-                        }
-                    }
-                    /* Gradient magnitude */
-                    sum = (abs(sumx) + abs(sumy));
-                }
-                outputImage[x][y] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
-            }
+        {
+            perf::Scope scope(perf::PHASE_COMPUTE, thread_num);
+            sobel_rect(rowBegin, rowEnd, 0, image_width);
         }
+        // the chunk is final, format it while other threads are still masking
+        {
+            perf::Scope scope(perf::PHASE_WRITE, thread_num);
+            format_rows(rowBegin, rowEnd);
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     } while(1);
 }
 
+/* Threads to use when none are given: hardware threads, limited to the cpus this process may run on */
+int detect_threads(){
+    int n = std::thread::hardware_concurrency();
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        n = n > 0 ? std::min(n, CPU_COUNT(&allowed)) : CPU_COUNT(&allowed);
+    return std::max(n, 1);
+}
+
+/* Static, affinity-matched worker: the thread that owns a block of chunks touches its pages first */
+void calcmask_numa(int thread_num){
+    numa::ScopedPin pin(thread_num);
+    if(!pin.ok()) fprintf(stdout, "Thread %d could not be pinned\n", thread_num);
+    int firstChunk = maxChunk*thread_num/num_threads, lastChunk = maxChunk*(thread_num+1)/num_threads;
+    int rowBegin = std::min(chunkSize*firstChunk, image_height), rowEnd = std::min(chunkSize*lastChunk, image_height);
+    sobel::ImageView in = image_view(inputImage), out = image_view(outputImage);
+    // first touch of the rows this thread reads and writes most
+    numa::first_touch(stagingImage.data(), in, out, rowBegin, rowEnd);
+    // halo rows are owned by the neighbours, wait until they are filled
+    pthread_barrier_wait(&touch_barrier);
+
+    numa::Block<int> block(in, rowBegin, rowEnd, replicateHalo);
+    for(int chunk = firstChunk; chunk < lastChunk; ++chunk){
+        fprintf(stdout, "Thread %d process chunk %d\n", thread_num, chunk);
+        perf::Scope compute(perf::PHASE_COMPUTE, thread_num);
+        block.filter<borderMode>(in, out, std::min(chunkSize*chunk, image_height), std::min(chunkSize*(chunk+1), image_height));
+        compute.end();
+        perf::Scope write(perf::PHASE_WRITE, thread_num);
+        format_rows(std::min(chunkSize*chunk, image_height), std::min(chunkSize*(chunk+1), image_height));
+    }
+}
+
+/* ****************Incremental (dirty tile) mode ***************** */
+
+/* Input tiles are hashed and compared with the hashes stored by the previous run.
+   Only changed tiles and the 1-pixel strips of their neighbours are filtered again,
+   the rest of outputImage comes from the state file. */
+const char stateMagic[8] = {'S', 'O', 'B', 'E', 'L', 'I', 'N', 'C'};
+const char* stateFile;
+bool hasState;
+tiles::Grid grid;
+std::vector<uint64_t> tileHash, prevHash;
+std::vector<int> worklist;
+std::atomic<int> nextTile;
+std::atomic<long> recomputedPixels;
+
+void hash_worker(int thread_num){
+    perf::Scope scope(perf::PHASE_COMPUTE, thread_num);
+    for(int ty = thread_num; ty < grid.rows; ty += num_threads){
+        // with numa the pixels are still staged, the thread hashing a row of tiles touches it first
+        if(numaPlacement)
+            for(int x = ty*tiles::TILE; x < std::min((ty+1)*tiles::TILE, image_height); ++x)
+                std::copy(&stagingImage[x*image_width], &stagingImage[(x+1)*image_width], inputImage[x]);
+        for(int tx = 0; tx < grid.cols; ++tx){
+            int t = ty*grid.cols + tx;
+            tileHash[t] = grid.hash<int>(image_view(inputImage), ty, tx);
+            grid.dirty[t] = !hasState || tileHash[t] != prevHash[t];
+        }
+    }
+}
+
+void recompute_worker(int thread_num){
+    perf::Scope scope(perf::PHASE_COMPUTE, thread_num);
+    long pixels = 0;
+    for(int i = nextTile++; i < (int)worklist.size(); i = nextTile++)
+        pixels += grid.recompute<borderMode, int, int>(image_view(inputImage), image_view(outputImage), worklist[i] / grid.cols, worklist[i] % grid.cols);
+    recomputedPixels += pixels;
+}
+
+void format_worker(int thread_num){
+    perf::Scope scope(perf::PHASE_WRITE, thread_num);
+    int rowBegin = image_height*thread_num/num_threads, rowEnd = image_height*(thread_num+1)/num_threads;
+    if(rowBegin < rowEnd) format_rows(rowBegin, rowEnd);
+}
+
+/* The state is only reused when it was written for an image of the same size and border mode */
+bool load_state(){
+    std::ifstream in(stateFile, std::ios::binary);
+    char magic[8];
+    int header[4];
+    if(!in.read(magic, 8) || !std::equal(magic, magic + 8, stateMagic) || !in.read((char*)header, sizeof(header))) return false;
+    if(header[0] != image_width || header[1] != image_height || header[2] != tiles::TILE || header[3] != borderMode) return false;
+    if(!in.read((char*)prevHash.data(), prevHash.size()*sizeof(uint64_t))) return false;
+    for(int x = 0; x < image_height; ++x)
+        if(!in.read((char*)outputImage[x], image_width*sizeof(int))) return false;
+    return true;
+}
+
+bool save_state(){
+    std::ofstream out(stateFile, std::ios::binary | std::ios::trunc);
+    int header[4] = {image_width, image_height, tiles::TILE, borderMode};
+    out.write(stateMagic, 8);
+    out.write((char*)header, sizeof(header));
+    out.write((char*)tileHash.data(), tileHash.size()*sizeof(uint64_t));
+    for(int x = 0; x < image_height; ++x) out.write((char*)outputImage[x], image_width*sizeof(int));
+    return (bool)out;
+}
+
+void dispatch_incremental(sobel::ThreadPool& pool){
+    grid = tiles::Grid(image_width, image_height, borderMode);
+    tileHash.assign(grid.size(), 0);
+    prevHash.assign(grid.size(), 0);
+    // a state that fails to load halfway leaves every tile dirty, so no stale rows survive
+    hasState = load_state();
+    pool.run_each(hash_worker);
+
+    int dirty = std::count(grid.dirty.begin(), grid.dirty.end(), 1);
+    worklist.clear();
+    for(int ty = 0; ty < grid.rows; ++ty)
+        for(int tx = 0; tx < grid.cols; ++tx)
+            if(grid.needs_work(ty, tx)) worklist.push_back(ty*grid.cols + tx);
+    nextTile = 0;
+    recomputedPixels = 0;
+    pool.run_each(recompute_worker);
+    pool.run_each(format_worker);
+
+    std::cout << "Incremental: " << dirty << " of " << grid.size() << " tiles changed, recomputed "
+              << recomputedPixels << " pixels, skipped " << 100.0*(1 - (double)recomputedPixels/(image_height*image_width))
+              << "% of the work" << std::endl;
+    if(!save_state()) std::cout << "ERROR: Could not write state file " << stateFile << std::endl;
+}
 
 void dispatch_threads(){
-    /* 3x3 Sobel mask for X Dimension. */
-    maskX[0][0] = -1; maskX[0][1] = 0; maskX[0][2] = 1;
-    maskX[1][0] = -2; maskX[1][1] = 0; maskX[1][2] = 2;
-    maskX[2][0] = -1; maskX[2][1] = 0; maskX[2][2] = 1;
-    /* 3x3 Sobel mask for Y Dimension. */
-    maskY[0][0] = 1; maskY[0][1] = 2; maskY[0][2] = 1;
-    maskY[1][0] = 0; maskY[1][1] = 0; maskY[1][2] = 0;
-    maskY[2][0] = -1; maskY[2][1] = -2; maskY[2][2] = -1;
     // setup chunks
     chunkcnt = -1;
-    // create threads
-    std::vector<std::thread> threads;
-    for(int i = 0; i < num_threads; ++i) threads.emplace_back(calcmask, i);
-    for(int i = 0; i < num_threads; ++i) threads[i].join();
+    nextRow = 0;
+    chunkOutput.assign(image_height, std::string());
+    // the workers are a library pool, the calling thread is thread 0
+    sobel::ThreadPool pool(num_threads);
+    if(stateFile){
+        dispatch_incremental(pool);
+        return;
+    }
+    if(numaPlacement) pthread_barrier_init(&touch_barrier, NULL, num_threads);
+    pool.run_each(numaPlacement ? calcmask_numa : calcmask);
+    if(!numaPlacement) std::cout << "Dispatched " << chunkcnt+1 << " chunks" << std::endl;
+    if(numaPlacement){
+        pthread_barrier_destroy(&touch_barrier);
+        numa::report_pages("inputImage", image_view(inputImage));
+        numa::report_pages("outputImage", image_view(outputImage));
+    }
+}
+
+/* Write the header and all formatted chunks with as few writev calls as possible */
+bool write_output(const char* filename){
+    std::string header = pgm::pgm_header(image_width, image_height, image_maxShades, binaryOutput);
+    std::vector<iovec> iov;
+    iov.push_back({&header[0], header.size()});
+    for(size_t i = 0; i < chunkOutput.size(); ++i)
+        if(!chunkOutput[i].empty()) iov.push_back({&chunkOutput[i][0], chunkOutput[i].size()});
+    return pgm::write_file(filename, iov.data(), iov.size());
 }
 
 /* **************** main ***************** */
 
 int main(int argc, char** argv){
-    if(argc != 5){
-        std::cout << "ERROR: Incorrect number of arguments. Format is: <Input image filename> <Output image filename> <Threads#> <Chunk size>" << std::endl;
+    if(argc < 5 || argc > 10){
+        std::cout << "ERROR: Incorrect number of arguments. Format is: <Input image filename> <Output image filename> <Threads#|auto> <Chunk size|guided|adaptive> [P2/P5] [numa] [replicate] [incremental <state file>]" << std::endl;
         return 0;
     }
  
@@ -98,12 +300,42 @@ int main(int argc, char** argv){
         std::cout << "ERROR: Could not open file " << argv[1] << std::endl;
         return 0;
     }
+    std::string threadArg = argv[3];
     num_threads = std::atoi(argv[3]);
+    if(threadArg != "auto" && (threadArg.empty() || threadArg.find_first_not_of("0123456789") != std::string::npos)){
+        std::cout << "ERROR: Threads# must be a number, 0 or auto" << std::endl;
+        return 0;
+    }
+    if(num_threads == 0) num_threads = detect_threads();
+    std::string chunkArg = argv[4];
+    chunkPolicy = chunkArg == "guided" ? CHUNK_GUIDED : chunkArg == "adaptive" ? CHUNK_ADAPTIVE : CHUNK_FIXED;
     chunkSize  = std::atoi(argv[4]);
+    if(chunkPolicy == CHUNK_FIXED && chunkSize <= 0){
+        std::cout << "ERROR: Chunk size must be a positive number, guided or adaptive" << std::endl;
+        return 0;
+    }
+    for(int i = 5; i < argc; ++i){
+        std::string opt = argv[i];
+        if(opt == "P5") binaryOutput = true;
+        else if(opt == "numa") numaPlacement = true;
+        else if(opt == "replicate") replicateHalo = true;
+        else if(opt == "incremental"){
+            if(i+1 == argc){
+                std::cout << "ERROR: incremental needs a state file" << std::endl;
+                return 0;
+            }
+            stateFile = argv[++i];
+        }
+    }
+    if(replicateHalo && (!numaPlacement || stateFile)){
+        std::cout << "ERROR: replicate only applies to numa without incremental" << std::endl;
+        return 0;
+    }
 
     std::cout << "Detect edges in " << argv[1] << " using " << num_threads << " threads" << std::endl;
 
     /* ******Reading image into 2-D array below******** */
+    perf::Scope parse(perf::PHASE_PARSE, -1);
 
     std::string workString;
     /* Remove comments '#' and check image format */ 
@@ -134,8 +366,12 @@ int main(int argc, char** argv){
         }
     }
 
+    /* Static numa blocks need a chunk size, guided and adaptive runs use one block per thread there */
+    if(chunkPolicy != CHUNK_FIXED) chunkSize = std::max(1, (int)ceil((float)image_height/num_threads));
     /* maxChunk is total number of chunks to process */
     maxChunk = ceil((float)image_height/chunkSize);
+    /* With numa placement pixels are staged here, the owning threads copy them into inputImage */
+    if(numaPlacement) stagingImage.assign(image_height*image_width, 0);
 
     /* Check image max shades */ 
     while(std::getline(file,workString)){
@@ -156,30 +392,26 @@ int main(int argc, char** argv){
                 if( !stream )
                     break;
                 stream >> pixel_val;
-                inputImage[i][j] = pixel_val;
+                if(numaPlacement) stagingImage[i*image_width+j] = pixel_val;
+                else inputImage[i][j] = pixel_val;
             }
         } else {
             continue;
         }
     }
 
+    parse.end();
+
     /************ Function that creates threads and manage dynamic allocation of chunks *********/
     dispatch_threads();
 
     /* ********Start writing output to your file************ */
-    std::ofstream ofile(argv[2]);
-    if( ofile.is_open() ){
-        ofile << "P2" << "\n" << image_width << " " << image_height << "\n" << image_maxShades << "\n";
-        for( int i = 0; i < image_height; i++ )
-        {
-            for( int j = 0; j < image_width; j++ ){
-                ofile << outputImage[i][j] << " ";
-            }
-            ofile << "\n";
-        }
-    } else {
+    perf::Scope write(perf::PHASE_WRITE, -1);
+    if( !write_output(argv[2]) ){
         std::cout << "ERROR: Could not open output file " << argv[2] << std::endl;
         return 0;
     }
+    write.end();
+    perf::report("pixel", (double)image_height*image_width);
     return 0;
 }
\ No newline at end of file
@@ -4,7 +4,10 @@
  * Development platform: g++ (Ubuntu 5.4.1-2ubuntu1~14.04) 5.4.1 20160904
  * Last modified date: 10 Feb 2017
  * Compilation: mpic++ -std=c++11 Sobel.cpp -o Sobel
-                mpirun -np <num_of_process> ./Sobel <input_image> <output_image>
+                  add -DSOBEL_BORDER=BORDER_REPLICATE/BORDER_REFLECT/BORDER_WRAP for gradients on the image border
+                mpirun -np <num_of_process> ./Sobel <input_image> <output_image> [P2/P5] [2d]
+                  2d: split the image into a 2D grid of blocks instead of horizontal strips
+                PERF_PHASES=1 mpirun ... prints hardware counters per phase on every process
  */
 
 #include "mpi.h"
@@ -15,56 +18,227 @@
 #include <sstream>
 #include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
+#include "../lib/Sobel.h"
+#include "../lib/Pgm.h"
+#include "../lib/Perf.h"
+
+#ifndef SOBEL_BORDER
+#define SOBEL_BORDER BORDER_ZERO
+#endif
+const sobel::BorderMode borderMode = sobel::SOBEL_BORDER;
 
 // ***************** Add/Change the functions(including processImage) here ********************* 
 
-int* processImage(int* imageInfo, int* chunkInfo){
-    int sum, sumx, sumy;
-    int GX[3][3], GY[3][3];
-    /* 3x3 Sobel masks. */
-    GX[0][0] = -1; GX[0][1] =  0; GX[0][2] =  1;
-    GX[1][0] = -2; GX[1][1] =  0; GX[1][2] =  2;
-    GX[2][0] = -1; GX[2][1] =  0; GX[2][2] =  1;
-    GY[0][0] =  1; GY[0][1] =  2; GY[0][2] =  1;
-    GY[1][0] =  0; GY[1][1] =  0; GY[1][2] =  0;
-    GY[2][0] = -1; GY[2][1] = -2; GY[2][2] = -1;
-
-    int image_height = chunkInfo[0]-2, image_width = chunkInfo[1];
-    int* outputChunk = new int[image_height*image_width];
-    std::fill(outputChunk, outputChunk + image_height*image_width, 0);
-	for(int x = 1; x <= image_height; x++){
-		for(int y = 1; y < image_width-1; y++){
-			sumx = sumy = 0;
-		    for(int i=-1; i<=1; i++){
-				for(int j=-1; j<=1; j++){
-					sumx += imageInfo[(x+i)*image_width+(y+j)] * GX[i+1][j+1];
-                    sumy += imageInfo[(x+i)*image_width+(y+j)] * GY[i+1][j+1];
-				}
-			}
-			sum = abs(sumx) + abs(sumy);
-			outputChunk[(x-1)*image_width + y] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
-		}
-	}
-	return outputChunk;
+// Format all rows of a chunk of the output as P2 text or P5 bytes
+std::string formatChunk(const sobel::ImageView& chunk, bool binaryOutput){
+    std::string out(pgm::formatted_size(chunk.width, chunk.height, binaryOutput), '\0');
+    out.resize(pgm::format_rows(chunk, 0, chunk.height, binaryOutput, &out[0]) - &out[0]);
+    return out;
+}
+
+// Write header and body, retrying on partial writes
+bool writeOutput(const char* filename, int image_width, int image_height, int image_maxShades, bool binaryOutput,
+                 char* body, size_t bodyLen){
+    std::string header = pgm::pgm_header(image_width, image_height, image_maxShades, binaryOutput);
+    iovec iov[2] = {{&header[0], header.size()}, {body, bodyLen}};
+    return pgm::write_file(filename, iov, 2);
+}
+
+// ***************** 2D decomposition ********************* 
+
+// Rows (or columns) [begin, end) of the image owned by grid coordinate coord out of dim
+void blockRange(int coord, int dim, int n, int& begin, int& end){
+    begin = n*coord/dim;
+    end = n*(coord+1)/dim;
+}
+
+// A rows x cols block at (rowBegin, colBegin) of a height x width int array
+MPI_Datatype subarrayType(int height, int width, int rows, int cols, int rowBegin, int colBegin){
+    int sizes[2] = {height, width}, subsizes[2] = {rows, cols}, starts[2] = {rowBegin, colBegin};
+    MPI_Datatype type;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_INT, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+// Local index (halo included) of the pixel that stands in for global index outside, -1 when there is none
+template<sobel::BorderMode mode>
+int borderSource(int outside, int begin, int n){
+    int i = sobel::Border<mode>::index(outside, n);
+    return i < 0 ? -1 : i - begin + 1;
+}
+
+// Fill the one pixel halo of a block. Columns go first as strided vectors, then whole rows including
+// the halo columns, which brings the corners along. On the image border the halo comes from the
+// border mode, except for wrap where the periodic grid already delivers the opposite side.
+void exchangeHalos(int* block, int rows, int cols, int rowBegin, int colBegin, int image_height, int image_width,
+                   MPI_Comm cart, int coords[2], int dims[2]){
+    int stride = cols+2, up, down, left, right;
+    MPI_Cart_shift(cart, 0, 1, &up, &down);
+    MPI_Cart_shift(cart, 1, 1, &left, &right);
+
+    MPI_Datatype column;
+    MPI_Type_vector(rows, 1, stride, MPI_INT, &column);
+    MPI_Type_commit(&column);
+    MPI_Sendrecv(block + stride + 1, 1, column, left, 0, block + stride + cols + 1, 1, column, right, 0, cart, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(block + stride + cols, 1, column, right, 1, block + stride, 1, column, left, 1, cart, MPI_STATUS_IGNORE);
+    MPI_Type_free(&column);
+    if (borderMode != sobel::BORDER_WRAP) {
+        int l = borderSource<borderMode>(-1, colBegin, image_width), r = borderSource<borderMode>(image_width, colBegin, image_width);
+        for (int x = 1; x <= rows; ++x) {
+            if (coords[1] == 0 && l >= 0) block[x*stride] = block[x*stride + l];
+            if (coords[1] == dims[1]-1 && r >= 0) block[x*stride + cols+1] = block[x*stride + r];
+        }
+    }
+
+    MPI_Sendrecv(block + stride, stride, MPI_INT, up, 2, block + (rows+1)*stride, stride, MPI_INT, down, 2, cart, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(block + rows*stride, stride, MPI_INT, down, 3, block, stride, MPI_INT, up, 3, cart, MPI_STATUS_IGNORE);
+    if (borderMode != sobel::BORDER_WRAP) {
+        int t = borderSource<borderMode>(-1, rowBegin, image_height), b = borderSource<borderMode>(image_height, rowBegin, image_height);
+        if (coords[0] == 0 && t >= 0) std::copy(block + t*stride, block + (t+1)*stride, block);
+        if (coords[0] == dims[0]-1 && b >= 0) std::copy(block + b*stride, block + (b+1)*stride, block + (rows+1)*stride);
+    }
+}
+
+// Filter a block whose halo is complete, so every pixel uses the same branch-free stencil
+int* processBlock(int* block, int rows, int cols, int rowBegin, int colBegin, int image_height, int image_width){
+    int stride = cols+2;
+    int* outputBlock = new int[rows*cols];
+    for (int x = 0; x < rows; ++x) {
+        sobel::gradient_span(block + x*stride + 1, block + (x+1)*stride + 1, block + (x+2)*stride + 1, outputBlock + x*cols, cols);
+    }
+    // with BORDER_ZERO the pixels on the image border stay 0
+    if (borderMode == sobel::BORDER_ZERO) {
+        for (int x = 0; x < rows; ++x) {
+            bool borderRow = rowBegin+x == 0 || rowBegin+x == image_height-1;
+            for (int y = 0; y < cols; ++y) {
+                if (borderRow || colBegin+y == 0 || colBegin+y == image_width-1) outputBlock[x*cols + y] = 0;
+            }
+        }
+    }
+    return outputBlock;
+}
+
+// Distribute blocks of a 2D process grid straight out of the input image, exchange only the block
+// perimeters and assemble the output in place on process 0, all through derived datatypes
+bool processImage2D(int processId, int num_processes, int* inputImage, int image_height, int image_width,
+                    int image_maxShades, const char* filename, bool binaryOutput){
+    int size[2] = {image_height, image_width};
+    MPI_Bcast(size, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    image_height = size[0];
+    image_width = size[1];
+
+    int dims[2] = {0, 0}, periods[2] = {borderMode == sobel::BORDER_WRAP, borderMode == sobel::BORDER_WRAP};
+    MPI_Dims_create(num_processes, 2, dims);
+    if (dims[0] > image_height || dims[1] > image_width) {
+        if (processId == 0)
+            std::cout << "ERROR: " << dims[0] << "x" << dims[1] << " process grid is larger than the image" << std::endl;
+        return true;
+    }
+    MPI_Comm cart;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &cart);
+    int cartRank, cartRoot, coords[2];
+    MPI_Comm_rank(cart, &cartRank);
+    MPI_Cart_coords(cart, cartRank, 2, coords);
+    // the grid may renumber processes, process 0 keeps the image whatever its rank in the grid
+    cartRoot = cartRank;
+    MPI_Bcast(&cartRoot, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (processId == 0)
+        std::cout << "Process grid " << dims[0] << "x" << dims[1] << std::endl;
+
+    int rowBegin, rowEnd, colBegin, colEnd;
+    blockRange(coords[0], dims[0], image_height, rowBegin, rowEnd);
+    blockRange(coords[1], dims[1], image_width, colBegin, colEnd);
+    int rows = rowEnd-rowBegin, cols = colEnd-colBegin;
+
+    perf::Scope distribute(perf::PHASE_DISTRIBUTE, processId);
+    std::vector<MPI_Request> requests;
+    if (processId == 0) {
+        requests.resize(num_processes);
+        for (int p = 0; p < num_processes; ++p) {
+            int c[2], r0, r1, c0, c1;
+            MPI_Cart_coords(cart, p, 2, c);
+            blockRange(c[0], dims[0], image_height, r0, r1);
+            blockRange(c[1], dims[1], image_width, c0, c1);
+            MPI_Datatype type = subarrayType(image_height, image_width, r1-r0, c1-c0, r0, c0);
+            MPI_Isend(inputImage, 1, type, p, 0, cart, &requests[p]);
+            MPI_Type_free(&type);
+        }
+    }
+    int* block = new int[(rows+2)*(cols+2)];
+    std::fill(block, block + (rows+2)*(cols+2), 0);
+    MPI_Datatype interior = subarrayType(rows+2, cols+2, rows, cols, 1, 1);
+    MPI_Recv(block, 1, interior, cartRoot, 0, cart, MPI_STATUS_IGNORE);
+    MPI_Type_free(&interior);
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    std::cout << "Process " << processId << " finished receiving block " << rows << "x" << cols << ".\n";
+
+    exchangeHalos(block, rows, cols, rowBegin, colBegin, image_height, image_width, cart, coords, dims);
+    distribute.end();
+    std::cout << "Process " << processId << " finished exchanging " << 2*(rows+cols)+4 << " halo pixels.\n";
+
+    perf::Scope compute(perf::PHASE_COMPUTE, processId);
+    int* outputBlock = processBlock(block, rows, cols, rowBegin, colBegin, image_height, image_width);
+    compute.end();
+    std::cout << "Process " << processId << " finished calculation.\n";
+
+    MPI_Request sent;
+    MPI_Isend(outputBlock, rows*cols, MPI_INT, cartRoot, 1, cart, &sent);
+    bool written = true;
+    if (processId == 0) {
+        int* outputImage = new int[image_height*image_width];
+        perf::Scope gather(perf::PHASE_REDUCE, processId);
+        for (int p = 0; p < num_processes; ++p) {
+            int c[2], r0, r1, c0, c1;
+            MPI_Cart_coords(cart, p, 2, c);
+            blockRange(c[0], dims[0], image_height, r0, r1);
+            blockRange(c[1], dims[1], image_width, c0, c1);
+            MPI_Datatype type = subarrayType(image_height, image_width, r1-r0, c1-c0, r0, c0);
+            MPI_Recv(outputImage, 1, type, p, 1, cart, MPI_STATUS_IGNORE);
+            MPI_Type_free(&type);
+        }
+        gather.end();
+        perf::Scope write(perf::PHASE_WRITE, processId);
+        std::string body = formatChunk(sobel::view(outputImage, image_width, image_height), binaryOutput);
+        written = writeOutput(filename, image_width, image_height, image_maxShades, binaryOutput, &body[0], body.size());
+        delete [] outputImage;
+    }
+    MPI_Wait(&sent, MPI_STATUS_IGNORE);
+    std::cout << "Process " << processId << " finished gathering output image block.\n";
+
+    perf::report("pixel", (double)rows*cols, "Process");
+
+    delete [] block;
+    delete [] outputBlock;
+    MPI_Comm_free(&cart);
+    return written;
 }
 
 int main(int argc, char* argv[]){
-	int processId, num_processes, image_height, image_width, image_maxShades;
-	int *inputImage;
+	int processId, num_processes, image_height = 0, image_width = 0, image_maxShades = 0;
+	int *inputImage = NULL;
 	
 	// Setup MPI
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &processId);
     MPI_Comm_size(MPI_COMM_WORLD, &num_processes);
 	
-    if(argc != 3){
+    if(argc < 3 || argc > 5){
 		if(processId == 0)
-			std::cout << "ERROR: Incorrect number of arguments. Format is: <Input image filename> <Output image filename>" << std::endl;
+			std::cout << "ERROR: Incorrect number of arguments. Format is: <Input image filename> <Output image filename> [P2/P5] [2d]" << std::endl;
 		MPI_Finalize();
         return 0;
     }
+    bool binaryOutput = false, decompose2d = false;
+    for (int i = 3; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "P5") binaryOutput = true;
+        else if (option == "2d") decompose2d = true;
+    }
 	
+	perf::Scope parse(perf::PHASE_PARSE, processId);
 	if(processId == 0){
 		std::ifstream file(argv[1]);
 		if(!file.is_open()){
@@ -124,117 +298,85 @@ int main(int argc, char* argv[]){
 			}
 		}
 	} // Done with reading image using process 0
+	parse.end();
 	
 	// ***************** Add code as per your requirement below ********************* 
 
-    int *inputChunk = NULL, *outputImage = NULL, *imageInfo = NULL, *newInputImage = NULL;
-    int *chunkInfo = new int[2], *outputChunk = NULL;
-
-    if (processId == 0) {
-    	int rows = ceil(image_height*1.0/num_processes);
-    	inputChunk = new int[num_processes*2];
-        for (int i = 0; i < num_processes; i++) {
-        	inputChunk[2*i]   = rows+2;
-        	inputChunk[2*i+1] = image_width;
-        }
-        outputImage = new int[rows*num_processes*image_width];
-        // modify inputImage so that the last/first line in a imagechunk will be kept
-        newInputImage = new int[(rows+2)*num_processes*image_width];
-        std::fill(newInputImage, newInputImage + (rows+2)*num_processes*image_width, 0);
-        for (int p = 0; p < num_processes; ++p) {
-        	// set first row from previous chunk
-        	if (p*rows > image_height) break;
-        	if (p) {
-        		for (int j = 0; j < image_width; ++j){
-        			newInputImage[p*(rows+2)*image_width + j] = inputImage[(p*rows-1)*image_width+j];
-        		}
-        	}
-        	// copy rows for each chunk
-        	for (int i = 0; i < rows; ++i){
-        		if (p*rows+i+1 > image_height) break;
-        		for (int j = 0; j < image_width; ++j){
-        			newInputImage[(p*(rows+2)+i+1)*image_width + j] = inputImage[(p*rows+i)*image_width+j];
-        		}
-        	}
-        	// set last row from next chunk
-        	if ((p+1)*rows+1 > image_height) break;
-        	if (p != num_processes - 1) {
-        		for (int j = 0; j < image_width; ++j) {
-        			newInputImage[((p+1)*(rows+2)-1)*image_width + j] = inputImage[(p+1)*rows*image_width+j];
-        		}
-        	}
+    if (decompose2d) {
+        bool written = processImage2D(processId, num_processes, inputImage, image_height, image_width, image_maxShades, argv[2], binaryOutput);
+        if (processId == 0) {
+            delete [] inputImage;
+            if (!written) std::cout << "ERROR: Could not open output file " << argv[2] << std::endl;
         }
+        MPI_Finalize();
+        return 0;
     }
 
-    // scatter image info 
-    MPI_Scatter(
-    	inputChunk, // void* send_data
-        2, // int send_count
-        MPI_INT, // MPI_Datatype send_datatype
-        chunkInfo, // void* recv_data
-        2, // int recv_count
-        MPI_INT, // MPI_Datatype recv_datatype
-        0, // int root
-        MPI_COMM_WORLD  // MPI_Comm communicator
-    );
-    std::cout << "Process " << processId << " finished scattering input image info.\n";
-
-    imageInfo = new int[chunkInfo[0]*chunkInfo[1]];
-    std::fill(imageInfo, imageInfo + chunkInfo[0]*chunkInfo[1], 0);
-
-    // scatter image chunk 
-    MPI_Scatter(
-    	newInputImage, // void* send_data
-        chunkInfo[0]*chunkInfo[1], // int send_count
-        MPI_INT, // MPI_Datatype send_datatype
-        imageInfo, // void* recv_data
-        chunkInfo[0]*chunkInfo[1], // int recv_count
-        MPI_INT, // MPI_Datatype recv_datatype
-        0, // int root
-        MPI_COMM_WORLD // MPI_Comm communicator
-    );
-    std::cout << "Process " << processId << " finished scattering input image chunk.\n";
-    
-    outputChunk = processImage(imageInfo, chunkInfo);
+    // process 0 sends every strip with the rows just outside it, mapped through the border mode,
+    // and each process filters its own strip through the library
+    perf::Scope distribute(perf::PHASE_DISTRIBUTE, processId);
+    sobel::Strip strip;
+    // an empty image makes every process return false, so all of them stop here
+    if (!sobel::receive_strip(sobel::view(inputImage, image_width, image_height), sobel::PIXEL_I32, strip, sobel::Mpi(), borderMode)) {
+        if (processId == 0) {
+            std::cout << "ERROR: " << argv[1] << " has no pixels" << std::endl;
+            delete [] inputImage;
+        }
+        MPI_Finalize();
+        return 0;
+    }
+    distribute.end();
+    perf::Scope compute(perf::PHASE_COMPUTE, processId);
+    sobel::filter_strip(strip);
+    compute.end();
     std::cout << "Process " << processId << " finished calculation.\n";
 
-    // gather image chunk
-    MPI_Gather(
-    	outputChunk, // void* send_data
-        (chunkInfo[0]-2)*chunkInfo[1], // int send_count
-        MPI_INT, // MPI_Datatype send_datatype
-        outputImage, // void* recv_data
-        (chunkInfo[0]-2)*chunkInfo[1], // int recv_count
-        MPI_INT, // MPI_Datatype recv_datatype
+    // every process formats its own rows, so root only concatenates bytes
+    int rowBegin = strip.begin, rowEnd = strip.end;
+    perf::Scope format(perf::PHASE_WRITE, processId);
+    std::string formatted = formatChunk(sobel::view(strip.row<int>(rowBegin), strip.width, rowEnd-rowBegin), binaryOutput);
+    int formattedLen = formatted.size();
+    format.end();
+    std::cout << "Process " << processId << " finished formatting.\n";
+
+    // gather formatted sizes, then the formatted chunks themselves
+    perf::Scope gather(perf::PHASE_REDUCE, processId);
+    std::vector<int> lengths(num_processes), displs(num_processes);
+    MPI_Gather(&formattedLen, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    size_t bodyLen = 0;
+    if (processId == 0) {
+        for (int p = 0; p < num_processes; ++p) {
+            displs[p] = bodyLen;
+            bodyLen += lengths[p];
+        }
+    }
+    std::vector<char> body(bodyLen);
+    MPI_Gatherv(
+        &formatted[0], // void* send_data
+        formattedLen, // int send_count
+        MPI_CHAR, // MPI_Datatype send_datatype
+        body.data(), // void* recv_data
+        lengths.data(), // int* recv_counts
+        displs.data(), // int* displacements
+        MPI_CHAR, // MPI_Datatype recv_datatype
         0, // int root
         MPI_COMM_WORLD // MPI_Comm communicator
     );
+    gather.end();
     std::cout << "Process " << processId << " finished gathering output image chunk.\n";
     
 	if (processId == 0) {
 		// Start writing output to your file
-		std::ofstream ofile(argv[2]);
-		if (ofile.is_open()) {
-			ofile << "P2" << "\n" << image_width << " " << image_height << "\n" << image_maxShades << "\n";
-			// first row
-			for (int j = 0; j < image_width; j++) ofile << 0 << " ";
-			ofile << "\n";
-			for (int i = 1; i < image_height -1; i++) {
-				for (int j = 0; j < image_width; j++) {
-					ofile << outputImage[i*image_width+j] << " ";
-				}
-				ofile << "\n";
-			}
-			// last row
-			for (int j = 0; j < image_width; j++) ofile << 0 << " ";
-			ofile << "\n";
-			delete [] inputChunk, outputImage, inputImage, newInputImage;
-		} else {
+		perf::Scope write(perf::PHASE_WRITE, processId);
+		bool written = writeOutput(argv[2], image_width, image_height, image_maxShades, binaryOutput, body.data(), bodyLen);
+		write.end();
+		delete [] inputImage;
+		if (!written) {
 			std::cout << "ERROR: Could not open output file " << argv[2] << std::endl;
 			return 0;
-		}	
+		}
 	}
-	delete [] chunkInfo, imageInfo, outputChunk;
+	perf::report("pixel", (double)(rowEnd-rowBegin)*strip.width, "Process");
 
     MPI_Finalize();
     return 0;
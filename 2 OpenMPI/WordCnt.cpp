@@ -4,7 +4,11 @@
  * Development platform: g++ (Ubuntu 5.4.1-2ubuntu1~14.04) 5.4.1 20160904
  * Last modified date: 14 Feb 2017
  * Compilation: mpic++ -std=c++11 WordCnt.cpp -o WordCnt
-                mpirun -np <num_of_process> ./WordCnt <filename> <word> <b1/b2>
+                mpirun -np <num_of_process> ./WordCnt <filename> <word> <b1/b2/dynamic> [slow rank] [slowdown factor]
+                  dynamic: ranks claim small blocks of the file through an RMA counter and read them with MPI-IO
+                  slow rank/slowdown factor: make one rank that many times slower, to compare the load balance
+                ./check_balance.sh [processes] [slow rank] [slowdown factor] checks that dynamic balances better than b1
+                PERF_PHASES=1 mpirun ... prints hardware counters per phase on every process
  */
 #include "mpi.h"
 #include <algorithm>
@@ -18,7 +22,16 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include "../lib/Perf.h"
 const static int ARRAY_SIZE = 130000;
+// Largest number of bytes of the file in one dynamically claimed block
+const static int BLOCK_SIZE = 16384;
+// Blocks per process the dynamic mode aims for, so a slow process can give away most of its share
+const static int BLOCKS_PER_PROCESS = 32;
+// Bytes read past a block to finish its last word, longer words are cut
+const static int LOOKAHEAD = 256;
 using Lines = char[ARRAY_SIZE][16];
 using Words = char[16];
 
@@ -49,6 +62,50 @@ int search_cnt(Words* words, int num, const char* target){
 
 //***************** Add your functions here *********************
 
+// Same letters as letter_only: everything from 'A' to 'z'
+inline bool is_letter(char c) {
+    return c >= 'A' && c <= 'z';
+}
+
+// Count target among the words that start inside block of the file. A word belongs to the
+// block it starts in, so the byte before the block tells whether the first letters belong to
+// the previous block, and the bytes after it finish the last word. words counts every word seen.
+int count_block(MPI_File file, MPI_Offset file_size, MPI_Offset block, MPI_Offset block_size, const char* target,
+                std::vector<char>& buf, int processId, long& words) {
+    MPI_Offset begin = block*block_size, end = std::min(begin + block_size, file_size);
+    MPI_Offset read_begin = begin > 0 ? begin-1 : 0, read_end = std::min(end + LOOKAHEAD, file_size);
+    perf::Scope parse(perf::PHASE_PARSE, processId);
+    MPI_File_read_at(file, read_begin, buf.data(), read_end - read_begin, MPI_CHAR, MPI_STATUS_IGNORE);
+    parse.end();
+
+    perf::Scope compute(perf::PHASE_COMPUTE, processId);
+
+    const char *p = buf.data() + (begin - read_begin), *block_end = buf.data() + (end - read_begin);
+    const char *data_end = buf.data() + (read_end - read_begin);
+    if (begin > 0 && is_letter(p[-1])) {
+        while (p < block_end && is_letter(*p)) ++p;
+    }
+    size_t len = strlen(target);
+    int cnt = 0;
+    while (p < block_end) {
+        if (!is_letter(*p)) {
+            ++p;
+            continue;
+        }
+        const char* word_begin = p;
+        while (p < data_end && is_letter(*p)) ++p;
+        if ((size_t)(p - word_begin) == len && !memcmp(word_begin, target, len)) ++cnt;
+        ++words;
+    }
+    return cnt;
+}
+
+// The slow rank sleeps so that its work takes factor times as long
+void slow_down(int processId, int slow_rank, double factor, double work_time) {
+    if (processId == slow_rank && factor > 1)
+        std::this_thread::sleep_for(std::chrono::duration<double>((factor-1)*work_time));
+}
+
 int main(int argc, char* argv[]) {
     int processId, num_processes, total_cnt = 0;
     int *to_return = NULL;
@@ -59,20 +116,26 @@ int main(int argc, char* argv[]) {
     MPI_Comm_rank(MPI_COMM_WORLD, &processId);
     MPI_Comm_size(MPI_COMM_WORLD, &num_processes);
  
-    // Three arguments: <input file> <search word> <part B1 or part B2 to execute>
-    if (argc != 4) {
+    // Three arguments: <input file> <search word> <part B1 or part B2 to execute>, optionally a rank to slow down
+    if (argc < 4 || argc > 6) {
         if(processId == 0) {
-            std::cout << "ERROR: Incorrect number of arguments. Format is: <filename> <word> <b1/b2>" << std::endl;
+            std::cout << "ERROR: Incorrect number of arguments. Format is: <filename> <word> <b1/b2/dynamic> [slow rank] [slowdown factor]" << std::endl;
         }
         MPI_Finalize();
         return 0;
     }
     const char* word = argv[2];
+    bool dynamic = !strcmp(argv[3], "dynamic");
+    int slow_rank = argc > 4 ? atoi(argv[4]) : -1;
+    double slowdown = argc > 5 ? atof(argv[5]) : 2;
+    double work_time = 0;
+    long words_searched = 0;
  
     Lines lines;
     int line_cnt = 0;
-    // Read the input file and put words into char array(lines)
-    if (processId == 0) {
+    // Read the input file and put words into char array(lines), the dynamic mode reads it on every rank instead
+    perf::Scope parse(perf::PHASE_PARSE, processId);
+    if (processId == 0 && !dynamic) {
         std::ifstream file;
         file.imbue(std::locale(std::locale(), new letter_only()));
         file.open(argv[1]);
@@ -82,6 +145,7 @@ int main(int argc, char* argv[]) {
             memcpy(lines[line_cnt++], workString.c_str(), workString.length());
         }
     }
+    parse.end();
     
 //  ***************** Add code as per your requirement below ***************** 
     
@@ -125,8 +189,15 @@ int main(int argc, char* argv[]) {
         );
 
         // start searching
+        double work_start = MPI_Wtime();
+        perf::Scope compute(perf::PHASE_COMPUTE, processId);
         int wordChunkCnt = search_cnt(wordsChunk, words_to_read, word);
+        compute.end();
+        words_searched = words_to_read;
+        slow_down(processId, slow_rank, slowdown, MPI_Wtime() - work_start);
+        work_time = MPI_Wtime() - work_start;
 
+        perf::Scope reduce(perf::PHASE_REDUCE, processId);
         if (!strcmp(argv[3], "b1")){
             // Using Reduction
             MPI_Reduce(
@@ -153,6 +224,7 @@ int main(int argc, char* argv[]) {
                 MPI_Send(&total_cnt, 1, MPI_INT, (processId+1)%(num_processes), 0, MPI_COMM_WORLD);
             }
         }
+        reduce.end();
         
         // output result
         if (processId == 0) {
@@ -162,7 +234,72 @@ int main(int argc, char* argv[]) {
             delete [] words_to_scatter;
         }
         delete [] wordsChunk;
+    } else if (dynamic) {
+        MPI_File file;
+        MPI_Offset file_size;
+        if (MPI_File_open(MPI_COMM_WORLD, argv[1], MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+            if (processId == 0) std::cout << "ERROR: Could not open file " << argv[1] << std::endl;
+            MPI_Finalize();
+            return 0;
+        }
+        MPI_File_get_size(file, &file_size);
+        // small files are cut into smaller blocks, otherwise one slow block decides when the search ends
+        MPI_Offset block_size = std::max<MPI_Offset>(1, std::min<MPI_Offset>(BLOCK_SIZE, file_size/(num_processes*BLOCKS_PER_PROCESS)));
+        MPI_Offset num_blocks = (file_size + block_size - 1)/block_size;
+
+        // the next unclaimed block lives in a window on process 0
+        int *next_block, one = 1, block, blocks_done = 0, local_cnt = 0;
+        MPI_Win win;
+        MPI_Win_allocate(processId == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &next_block, &win);
+        if (processId == 0) {
+            MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, win);
+            *next_block = 0;
+            MPI_Win_unlock(0, win);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        std::vector<char> buf(BLOCK_SIZE + LOOKAHEAD + 1);
+        MPI_Win_lock_all(0, win);
+        double search_start = MPI_Wtime();
+        for (;;) {
+            MPI_Fetch_and_op(&one, &block, MPI_INT, 0, 0, MPI_SUM, win);
+            MPI_Win_flush(0, win);
+            if (block >= num_blocks) break;
+            double work_start = MPI_Wtime();
+            local_cnt += count_block(file, file_size, block, block_size, word, buf, processId, words_searched);
+            slow_down(processId, slow_rank, slowdown, MPI_Wtime() - work_start);
+            // waiting for a block counts as well, a rank is only done when no block is left
+            work_time = MPI_Wtime() - search_start;
+            ++blocks_done;
+        }
+        MPI_Win_unlock_all(win);
+
+        perf::Scope reduce(perf::PHASE_REDUCE, processId);
+        MPI_Reduce(&local_cnt, &total_cnt, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+        std::vector<int> blocks_per_rank(num_processes);
+        MPI_Gather(&blocks_done, 1, MPI_INT, blocks_per_rank.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+        reduce.end();
+        if (processId == 0) {
+            DoOutput(std::string(word), total_cnt);
+            end_time = MPI_Wtime();
+            std::cout << "Time: " << ((double)end_time-start_time) << std::endl;
+            std::cout << "Blocks per rank:";
+            for (int i = 0; i < num_processes; ++i) std::cout << " " << blocks_per_rank[i];
+            std::cout << std::endl;
+        }
+        MPI_Win_free(&win);
+        MPI_File_close(&file);
+    }
+
+    // how unevenly the work was spread: when the last rank finished its share against the average
+    double max_work, sum_work;
+    MPI_Reduce(&work_time, &max_work, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&work_time, &sum_work, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (processId == 0 && sum_work > 0) {
+        std::cout << "Work time: max " << max_work << ", avg " << sum_work/num_processes
+                  << ", imbalance " << max_work/(sum_work/num_processes) << std::endl;
     }
+    perf::report("word", words_searched, "Process");
 
     MPI_Finalize();
     return 0;
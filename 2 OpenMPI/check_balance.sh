@@ -0,0 +1,52 @@
+#!/bin/sh
+# Check that the dynamic mode of WordCnt spreads the work of a slowed rank better than b1
+# Usage: mpic++ -std=c++11 WordCnt.cpp -o WordCnt
+#        ./check_balance.sh [processes] [slow rank] [slowdown factor]
+#        MPIRUN="mpirun --oversubscribe" ./check_balance.sh   to pass options to mpirun
+# Both modes have to find the same count, and dynamic has to bring the imbalance down to at most
+# two thirds of the b1 imbalance. Exits 1 when either does not hold.
+
+cd "$(dirname "$0")" || exit 1
+NP=${1:-4}
+SLOW_RANK=${2:-1}
+FACTOR=${3:-8}
+MPIRUN=${MPIRUN:-mpirun}
+BOOK=WordCnt_Book.txt
+WORD=the
+
+if [ ! -x ./WordCnt ]; then
+    echo "ERROR: build ./WordCnt first"
+    exit 1
+fi
+
+run() {
+    $MPIRUN -np "$NP" ./WordCnt "$BOOK" "$WORD" "$1" "$SLOW_RANK" "$FACTOR" > "balance_$1.out" 2>&1
+}
+
+if ! run b1 || ! run dynamic; then
+    cat balance_b1.out balance_dynamic.out
+    exit 1
+fi
+
+count() { sed -n 's/^Word Frequency: .* -> \([0-9]*\).*/\1/p' "balance_$1.out"; }
+imbalance() { sed -n 's/^Work time: .*imbalance \([0-9.eE+-]*\).*/\1/p' "balance_$1.out"; }
+
+b1_count=$(count b1)
+dynamic_count=$(count dynamic)
+b1_imbalance=$(imbalance b1)
+dynamic_imbalance=$(imbalance dynamic)
+rm -f balance_b1.out balance_dynamic.out
+
+echo "b1:      count $b1_count, imbalance $b1_imbalance"
+echo "dynamic: count $dynamic_count, imbalance $dynamic_imbalance"
+
+if [ -z "$b1_count" ] || [ "$b1_count" != "$dynamic_count" ]; then
+    echo "FAIL: counts differ"
+    exit 1
+fi
+if [ -z "$b1_imbalance" ] || [ -z "$dynamic_imbalance" ] ||
+   ! awk -v b="$b1_imbalance" -v d="$dynamic_imbalance" 'BEGIN { exit !(d*3 <= b*2) }'; then
+    echo "FAIL: dynamic does not lower the imbalance enough"
+    exit 1
+fi
+echo "PASS"
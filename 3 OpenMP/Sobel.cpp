@@ -3,8 +3,16 @@
  * Development platform: g++ (Ubuntu 5.4.1-2ubuntu1~14.04) 5.4.1 20160904
  * Last modified date: 6 March 2017
  * Compilation: g++ -fopenmp Implementation.cpp -o Sobel
+                  add -DSOBEL_BORDER=BORDER_REPLICATE/BORDER_REFLECT/BORDER_WRAP for gradients on the image border
                 export OMP_NUM_THREADS=<#threads>
-                ./Sobel <Input image filename> <Output image filename> <Chunk size> <a1/a2>
+                ./Sobel <Input image filename> <Output image filename> <Chunk size> <a1/a2/numa> [P2/P5] [replicate]
+                  numa: static blocks of chunks, each thread first-touches its rows and is bound to a place
+                        (OMP_PLACES/OMP_PROC_BIND when set, otherwise pinned to the n-th allowed cpu)
+                  replicate: with numa, every thread also keeps node-local copies of its two halo rows
+                ./Sobel <Input frames> <Output frames> <Chunk size> stream [P2/P5] [incremental]
+                  Frames are a printf pattern (frame%04d.pgm), one file of concatenated PGMs, or - for stdin/stdout
+                  incremental: only recompute the tiles of a frame whose input changed since the previous frame
+               PERF_PHASES=1 ./Sobel ... prints hardware counters per phase and thread
  * Test platform: openlab.ics.uci.edu
  */
 
@@ -16,7 +24,19 @@
 #include <sstream>
 #include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "../lib/Sobel.h"
+#include "../lib/Numa.h"
+#include "../lib/Pgm.h"
+#include "../lib/Tiles.h"
+#include "../lib/Perf.h"
  
 /* Global variables, Look at their usage in main() */
 int image_height;
@@ -25,34 +45,57 @@ int image_maxShades;
 int inputImage[1000][1000];
 int outputImage[1000][1000];
 int chunkSize;
-int maskX[3][3];
-int maskY[3][3];
+bool binaryOutput;
+bool replicateHalo;
+std::vector<int> stagingImage;
+std::vector<std::string> chunkOutput;
 std::vector<std::pair<int, int> > thread_rows;
 
+#ifndef SOBEL_BORDER
+#define SOBEL_BORDER BORDER_ZERO
+#endif
+const sobel::BorderMode borderMode = sobel::SOBEL_BORDER;
+
 /* ****************Change and add functions below ***************** */
 
-void Sobel(int chunkcnt){
-    int sumx, sumy, sum;
-    for(int x = chunkSize*chunkcnt; x < chunkSize*(chunkcnt+1); ++x){
-        for(int y = 0; y < image_width; ++y){
-            sumx = 0; sumy = 0;
-            if( x <= 0 || x >= (image_height-1) || y <= 0 || y >= (image_width-1)) sum = 0;
-            else {
-                for (int i = -1; i <= 1; ++i) {
-                    for (int j = -1; j <= 1; ++j){
-                        sumx += inputImage[x+i][y+j] * maskX[i+1][j+1];
-                        sumy += inputImage[x+i][y+j] * maskY[i+1][j+1];
-                    }
-                }
-                sum = (abs(sumx) + abs(sumy));
-            }
-            outputImage[x][y] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
-        }
-    }
+// An image as a library view, the filter itself lives in lib/Sobel.h
+sobel::ImageView image_view(int (*image)[1000]) {
+    return sobel::view(&image[0][0], image_width, image_height, sizeof(image[0]));
+}
+
+// Filter the rectangle of rows [r0, r1) and columns [c0, c1)
+void sobel_rect(int (*inputImage)[1000], int (*outputImage)[1000], int r0, int r1, int c0, int c1) {
+    sobel::sobel_rect<borderMode, int, int>(image_view(inputImage), image_view(outputImage), r0, r1, c0, c1);
+}
+
+// Filter the rows of one chunk
+void Sobel(int chunkcnt, int (*inputImage)[1000] = ::inputImage, int (*outputImage)[1000] = ::outputImage){
+    int rowBegin = chunkSize*chunkcnt, rowEnd = std::min(chunkSize*(chunkcnt+1), image_height);
+    sobel_rect(inputImage, outputImage, rowBegin, rowEnd, 0, image_width);
+}
+
+// Format the finished rows of a chunk into its own buffer
+void format_chunk(int chunkcnt) {
+    int rowBegin = chunkSize*chunkcnt, rowEnd = std::min(chunkSize*(chunkcnt+1), image_height);
+    std::string& out = chunkOutput[chunkcnt];
+    if (rowBegin >= rowEnd) return;
+    out.resize(pgm::formatted_size(image_width, rowEnd-rowBegin, binaryOutput));
+    out.resize(pgm::format_rows(image_view(outputImage), rowBegin, rowEnd, binaryOutput, &out[0]) - &out[0]);
+}
+
+// Write the header and all formatted chunks
+bool write_output(const char* filename) {
+    std::string header = pgm::pgm_header(image_width, image_height, image_maxShades, binaryOutput);
+    std::vector<iovec> iov;
+    iov.push_back({&header[0], header.size()});
+    for (size_t i = 0; i < chunkOutput.size(); ++i)
+        if (!chunkOutput[i].empty()) iov.push_back({&chunkOutput[i][0], chunkOutput[i].size()});
+    return pgm::write_file(filename, iov.data(), iov.size());
 }
 
 void compute_sobel_static() {
     int thread_id, num_chunks = ceil(image_height*1.0/chunkSize);
+    chunkOutput.assign(num_chunks, std::string());
 
 // start static scheduling
 #pragma omp parallel for schedule(static) private(thread_id) 
@@ -63,12 +106,18 @@ void compute_sobel_static() {
 #pragma omp critical
         thread_rows.push_back(std::make_pair(thread_id, i*chunkSize));
 
-        Sobel(i);
+        {
+            perf::Scope scope(perf::PHASE_COMPUTE, thread_id);
+            Sobel(i);
+        }
+        perf::Scope scope(perf::PHASE_WRITE, thread_id);
+        format_chunk(i);
     }
 }
 
 void compute_sobel_dynamic() {
     int thread_id, num_chunks = ceil(image_height*1.0/chunkSize);
+    chunkOutput.assign(num_chunks, std::string());
 
 // start dynamic scheduling
 #pragma omp parallel for schedule(dynamic) private(thread_id) 
@@ -79,29 +128,363 @@ void compute_sobel_dynamic() {
 #pragma omp critical
         thread_rows.push_back(std::make_pair(thread_id, i*chunkSize));
 
-        Sobel(i);
+        {
+            perf::Scope scope(perf::PHASE_COMPUTE, thread_id);
+            Sobel(i);
+        }
+        perf::Scope scope(perf::PHASE_WRITE, thread_id);
+        format_chunk(i);
+    }
+
+}
+/* ****************NUMA-aware placement ***************** */
+
+// Every thread owns one contiguous block of chunks: it first-touches those rows,
+// then filters them, so most reads and writes hit memory on its own node.
+void compute_sobel_numa() {
+    int num_chunks = ceil(image_height*1.0/chunkSize);
+    chunkOutput.assign(num_chunks, std::string());
+    bool bound = omp_get_proc_bind() != omp_proc_bind_false;
+
+#pragma omp parallel
+    {
+        int thread_id = omp_get_thread_num(), num_threads = omp_get_num_threads();
+        // OpenMP keeps its threads, so the pin is undone at the end of the region
+        numa::ScopedPin pin(thread_id, !bound);
+        if (!bound && !pin.ok()) {
+#pragma omp critical
+            std::cout << "Thread " << thread_id << " could not be pinned\n";
+        }
+        int firstChunk = num_chunks*thread_id/num_threads, lastChunk = num_chunks*(thread_id+1)/num_threads;
+        int rowBegin = std::min(chunkSize*firstChunk, image_height), rowEnd = std::min(chunkSize*lastChunk, image_height);
+        sobel::ImageView in = image_view(inputImage), out = image_view(outputImage);
+        numa::first_touch(stagingImage.data(), in, out, rowBegin, rowEnd);
+// halo rows are owned by the neighbours, wait until they are filled
+#pragma omp barrier
+
+        numa::Block<int> block(in, rowBegin, rowEnd, replicateHalo);
+        for (int i = firstChunk; i < lastChunk; ++i) {
+#pragma omp critical
+            thread_rows.push_back(std::make_pair(thread_id, i*chunkSize));
+
+            perf::Scope compute(perf::PHASE_COMPUTE, thread_id);
+            block.filter<borderMode>(in, out, std::min(chunkSize*i, image_height), std::min(chunkSize*(i+1), image_height));
+            compute.end();
+            perf::Scope write(perf::PHASE_WRITE, thread_id);
+            format_chunk(i);
+        }
+    }
+}
+
+/* ****************Frame-sequence (stream) mode ***************** */
+
+// Frames in flight: one decoding, one filtering and one encoding
+const int POOL_SIZE = 3;
+
+struct FrameSlot {
+    int input[1000][1000];
+    int output[1000][1000];
+    int maxShades;
+    std::string encoded;
+    double start;
+    // incremental mode: input tile hashes and the frame whose output this slot holds
+    std::vector<uint64_t> hashes;
+    int lastFrame;
+};
+
+// Incremental mode compares tile hashes of consecutive frames and only filters changed tiles
+// plus the 1-pixel strips of their neighbours. A slot holds the output of an older frame,
+// so tiles whose output changed since then are first copied from the previous frame.
+bool incremental;
+tiles::Grid grid;
+std::vector<int> outputChanged;
+long recomputedPixels, totalPixels;
+
+// Filter frame into slot, prev holds the fully filtered previous frame or NULL for the first one.
+// Filters of consecutive frames run in order, so grid and outputChanged are not shared between frames.
+void filter_incremental(FrameSlot& slot, FrameSlot* prev, int frame) {
+    sobel::ImageView in = image_view(slot.input), out = image_view(slot.output);
+// slot is a reference, firstprivate would copy the whole frame
+#pragma omp taskloop grainsize(1) shared(slot, in)
+    for (int ty = 0; ty < grid.rows; ++ty) {
+        perf::Scope scope(perf::PHASE_COMPUTE, omp_get_thread_num());
+        for (int tx = 0; tx < grid.cols; ++tx) {
+            int t = ty*grid.cols + tx;
+            slot.hashes[t] = grid.hash<int>(in, ty, tx);
+            grid.dirty[t] = !prev || slot.hashes[t] != prev->hashes[t];
+        }
+    }
+
+    long pixels = 0;
+#pragma omp taskloop grainsize(4) shared(slot, pixels, in, out)
+    for (int t = 0; t < grid.size(); ++t) {
+        perf::Scope scope(perf::PHASE_COMPUTE, omp_get_thread_num());
+        int ty = t / grid.cols, tx = t % grid.cols;
+        if (prev && outputChanged[t] > slot.lastFrame) {
+            int r0, r1, c0, c1;
+            grid.bounds(ty, tx, r0, r1, c0, c1);
+            for (int x = r0; x < r1; ++x) std::copy(prev->output[x] + c0, prev->output[x] + c1, slot.output[x] + c0);
+        }
+        if (grid.needs_work(ty, tx)) {
+            long tilePixels = grid.recompute<borderMode, int, int>(in, out, ty, tx);
+            outputChanged[t] = frame;
+#pragma omp atomic
+            pixels += tilePixels;
+        }
+    }
+    slot.lastFrame = frame;
+    recomputedPixels += pixels;
+    totalPixels += (long)image_height*image_width;
+}
+
+// Frames come from a printf pattern (one file per frame), a file of concatenated PGMs or stdin
+struct FrameSource {
+    const char* pattern;
+    bool sequence;
+    int index;
+    std::ifstream file;
+    std::istream* in;
+};
+
+// Frames go to a printf pattern (one file per frame), a file of concatenated PGMs or stdout
+struct FrameSink {
+    const char* pattern;
+    bool sequence;
+    int fd;
+};
+
+// Read the next header integer, skipping whitespace and '#' comments
+bool read_header_int(std::istream& in, int& v) {
+    int c;
+    while ((c = in.peek()) != EOF) {
+        if (c == '#') {
+            in.ignore(1 << 20, '\n');
+        } else if (isspace(c)) {
+            in.get();
+        } else {
+            break;
+        }
+    }
+    return (bool)(in >> v);
+}
+
+// End of stream is only reached where the next frame would start, anything else that fails is a bad frame
+enum FrameStatus { FRAME_END, FRAME_OK, FRAME_BAD };
+
+// Decode one P2 or P5 frame into img
+FrameStatus read_frame(std::istream& in, int (*img)[1000], int& width, int& height, int& maxShades) {
+    char magic[2];
+    if (!(in >> magic[0])) return FRAME_END;
+    if (!in.get(magic[1]) || magic[0] != 'P' || (magic[1] != '2' && magic[1] != '5')) return FRAME_BAD;
+    if (!read_header_int(in, width) || !read_header_int(in, height) || !read_header_int(in, maxShades)) return FRAME_BAD;
+    if (width <= 0 || height <= 0 || width > 1000 || height > 1000) return FRAME_BAD;
+    if (magic[1] == '2') {
+        for (int i = 0; i < height; ++i)
+            for (int j = 0; j < width; ++j)
+                if (!(in >> img[i][j])) return FRAME_BAD;
+        return FRAME_OK;
     }
+    // P5: a single whitespace then raw samples, two bytes big-endian when maxShades > 255
+    in.get();
+    int bytes = maxShades > 255 ? 2 : 1;
+    unsigned char row[2000];
+    for (int i = 0; i < height; ++i) {
+        if (!in.read((char*)row, width*bytes)) return FRAME_BAD;
+        for (int j = 0; j < width; ++j)
+            img[i][j] = bytes == 1 ? row[j] : (row[2*j] << 8 | row[2*j+1]);
+    }
+    return FRAME_OK;
+}
+
+// A sequence ends at its first missing file
+FrameStatus next_frame(FrameSource& src, FrameSlot& slot, int& width, int& height) {
+    if (src.sequence) {
+        char name[4096];
+        snprintf(name, sizeof(name), src.pattern, src.index++);
+        src.file.close();
+        src.file.clear();
+        src.file.open(name, std::ios::binary);
+        if (!src.file.is_open()) return FRAME_END;
+    }
+    return read_frame(*src.in, slot.input, width, height, slot.maxShades);
+}
+
+bool emit_frame(FrameSink& sink, FrameSlot& slot, int frame) {
+    iovec iov = {&slot.encoded[0], slot.encoded.size()};
+    if (!sink.sequence) return pgm::writev_all(sink.fd, &iov, 1);
+    char name[4096];
+    snprintf(name, sizeof(name), sink.pattern, frame);
+    return pgm::write_file(name, &iov, 1);
+}
+
+double percentile(std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size()-1, (size_t)(p*sorted.size()))];
+}
+
+// Decode, filter and encode consecutive frames concurrently.
+// The master thread decodes in stream order, filter and encode run as dependent tasks,
+// and a slot is only decoded into again once the encode of its previous frame is done.
+int compute_sobel_stream(const char* input, const char* output) {
+    FrameSource src;
+    src.pattern = input;
+    src.sequence = strchr(input, '%') != NULL;
+    src.index = 0;
+    if (!strcmp(input, "-")) {
+        std::ios::sync_with_stdio(false);
+        src.in = &std::cin;
+    } else {
+        if (!src.sequence) src.file.open(input, std::ios::binary);
+        src.in = &src.file;
+    }
+
+    FrameSink sink;
+    sink.pattern = output;
+    sink.sequence = strchr(output, '%') != NULL;
+    sink.fd = !strcmp(output, "-") ? 1 : sink.sequence ? -1 : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!sink.sequence && sink.fd < 0) {
+        std::cerr << "ERROR: Could not open output file " << output << std::endl;
+        return 0;
+    }
+
+    // all frame buffers are allocated once, up front
+    std::vector<FrameSlot> pool(POOL_SIZE);
+    for (int k = 0; k < POOL_SIZE; ++k) pool[k].encoded.reserve(pgm::HEADER_MAX + pgm::formatted_size(1000, 1000, false));
+    std::vector<double> latencies;
+    latencies.reserve(1 << 16);
+    // only their addresses are used, as task dependences
+    char slotTag[POOL_SIZE], filterTag[POOL_SIZE], sinkTag;
+    (void)slotTag; (void)filterTag; (void)sinkTag;
+    bool failed = false;
+    int frames = 0;
+
+    double dtime_stream = omp_get_wtime();
+#pragma omp parallel
+#pragma omp single
+    for (;;) {
+        int k = frames % POOL_SIZE, width, height;
+        bool stop;
+#pragma omp atomic read
+        stop = failed;
+        if (stop) break;
+
+// wait until the encode of the frame that used this slot has finished
+#pragma omp taskwait depend(inout: slotTag[k])
+        double start = omp_get_wtime();
+        perf::Scope parse(perf::PHASE_PARSE, omp_get_thread_num());
+        FrameStatus status = next_frame(src, pool[k], width, height);
+        parse.end();
+        if (status == FRAME_END) break;
+        if (status == FRAME_BAD) {
+            std::cerr << "ERROR: Frame " << frames << " is truncated or malformed" << std::endl;
+            break;
+        }
+        if (frames == 0) {
+            image_width = width;
+            image_height = height;
+            if (incremental) {
+                grid = tiles::Grid(image_width, image_height, borderMode);
+                outputChanged.assign(grid.size(), -1);
+                for (int s = 0; s < POOL_SIZE; ++s) {
+                    pool[s].hashes.assign(grid.size(), 0);
+                    pool[s].lastFrame = -1;
+                }
+            }
+        } else if (width != image_width || height != image_height) {
+            std::cerr << "ERROR: Frame " << frames << " is " << width << "x" << height
+                      << ", expected " << image_width << "x" << image_height << std::endl;
+            break;
+        }
+        pool[k].start = start;
+
+        if (incremental) {
+            // reads the output of the previous frame's filter, so filters run in frame order
+            int prev = (k + POOL_SIZE - 1) % POOL_SIZE;
+#pragma omp task depend(inout: slotTag[k]) depend(in: filterTag[prev]) depend(out: filterTag[k]) firstprivate(k, prev, frames)
+            filter_incremental(pool[k], frames ? &pool[prev] : NULL, frames);
+        } else {
+#pragma omp task depend(inout: slotTag[k]) firstprivate(k)
+            {
+                int num_chunks = ceil(image_height*1.0/chunkSize);
+#pragma omp taskloop grainsize(1)
+                for (int i = 0; i < num_chunks; ++i) {
+                    perf::Scope scope(perf::PHASE_COMPUTE, omp_get_thread_num());
+                    Sobel(i, pool[k].input, pool[k].output);
+                }
+            }
+        }
 
+#pragma omp task depend(inout: slotTag[k]) depend(inout: sinkTag) firstprivate(k) firstprivate(frames)
+        {
+            FrameSlot& slot = pool[k];
+            perf::Scope scope(perf::PHASE_WRITE, omp_get_thread_num());
+            // stays within the reserved capacity, so encoding a frame does not allocate
+            slot.encoded.resize(pgm::HEADER_MAX + pgm::formatted_size(image_width, image_height, binaryOutput));
+            int headerLen = pgm::pgm_header(&slot.encoded[0], image_width, image_height, slot.maxShades, binaryOutput);
+            char* end = pgm::format_rows(image_view(slot.output), 0, image_height, binaryOutput, &slot.encoded[headerLen]);
+            slot.encoded.resize(end - &slot.encoded[0]);
+            if (emit_frame(sink, slot, frames)) {
+                latencies.push_back(omp_get_wtime() - slot.start);
+            } else {
+#pragma omp atomic write
+                failed = true;
+            }
+        }
+        ++frames;
+    }
+    dtime_stream = omp_get_wtime() - dtime_stream;
+    if (!sink.sequence && sink.fd > 1) close(sink.fd);
+
+    if (failed) std::cerr << "ERROR: Could not write output frames to " << output << std::endl;
+    std::sort(latencies.begin(), latencies.end());
+    // stdout may carry the frames themselves, so statistics go to stderr
+    std::cerr << "Stream Method Time: " << dtime_stream << " seconds, " << latencies.size() << " frames, "
+              << latencies.size()/dtime_stream << " frames/sec\n";
+    std::cerr << "Frame latency (ms): p50 " << percentile(latencies, 0.5)*1e3 << ", p90 " << percentile(latencies, 0.9)*1e3
+              << ", p99 " << percentile(latencies, 0.99)*1e3 << ", max " << percentile(latencies, 1.0)*1e3 << "\n";
+    if (incremental && totalPixels)
+        std::cerr << "Incremental: recomputed " << recomputedPixels << " of " << totalPixels << " pixels, skipped "
+                  << 100.0*(1 - (double)recomputedPixels/totalPixels) << "% of the work\n";
+    perf::report("pixel", (double)image_height*image_width*frames, "Thread", std::cerr);
+    return 0;
 }
+
 /* **************** Change the function below if you need to ***************** */
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 5) {
-        std::cout << "ERROR: Incorrect number of arguments. Format is: <Input image filename> <Output image filename> <Chunk size> <a1/a2>" << std::endl;
+    if (argc < 5 || argc > 8) {
+        std::cout << "ERROR: Incorrect number of arguments. Format is: <Input image filename> <Output image filename> <Chunk size> <a1/a2/numa/stream> [P2/P5] [replicate] [incremental]" << std::endl;
         return 0;
     }
+    chunkSize  = std::atoi(argv[3]);
+    for (int i = 5; i < argc; ++i) {
+        if (!strcmp(argv[i], "P5")) binaryOutput = true;
+        else if (!strcmp(argv[i], "replicate")) replicateHalo = true;
+        else if (!strcmp(argv[i], "incremental")) incremental = true;
+    }
+
+    std::string opt = argv[4];
+    if (incremental && opt.compare("stream")) {
+        std::cout << "ERROR: incremental only applies to stream" << std::endl;
+        return 0;
+    }
+    if (replicateHalo && opt.compare("numa")) {
+        std::cout << "ERROR: replicate only applies to numa" << std::endl;
+        return 0;
+    }
+    if (!opt.compare("stream")) return compute_sobel_stream(argv[1], argv[2]);
  
     std::ifstream file(argv[1]);
     if (!file.is_open()) {
         std::cout << "ERROR: Could not open file " << argv[1] << std::endl;
         return 0;
     }
-    chunkSize  = std::atoi(argv[3]);
 
     // std::cout << "Detect edges in " << argv[1] << " using OpenMP threads" << std::endl;
 
     /* ******Reading image into 2-D array below******** */
+    perf::Scope parse(perf::PHASE_PARSE, -1);
 
     std::string workString;
     /* Remove comments '#' and check image format */ 
@@ -139,6 +522,10 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    /* With numa placement pixels are staged here, the owning threads copy them into inputImage */
+    bool numaPlacement = !opt.compare("numa");
+    if (numaPlacement) stagingImage.assign(image_height*image_width, 0);
+
     /* Fill input image matrix */ 
     int pixel_val;
     for (int i = 0; i < image_height; ++i) {
@@ -147,28 +534,27 @@ int main(int argc, char* argv[]) {
             for (int j = 0; j < image_width; ++j) {
                 if(!stream) break;
                 stream >> pixel_val;
-                inputImage[i][j] = pixel_val;
+                if (numaPlacement) stagingImage[i*image_width+j] = pixel_val;
+                else inputImage[i][j] = pixel_val;
             }
         }
     }
 
-    /************ Set up Sobel *********/
-    /* 3x3 Sobel mask for X Dimension. */
-    maskX[0][0] = -1; maskX[0][1] = 0; maskX[0][2] = 1;
-    maskX[1][0] = -2; maskX[1][1] = 0; maskX[1][2] = 2;
-    maskX[2][0] = -1; maskX[2][1] = 0; maskX[2][2] = 1;
-    /* 3x3 Sobel mask for Y Dimension. */
-    maskY[0][0] = 1; maskY[0][1] = 2; maskY[0][2] = 1;
-    maskY[1][0] = 0; maskY[1][1] = 0; maskY[1][2] = 0;
-    maskY[2][0] = -1; maskY[2][1] = -2; maskY[2][2] = -1;
+    parse.end();
 
     /************ Call functions to process image *********/
-    std::string opt = argv[4];
     if (!opt.compare("a1")) {    
         double dtime_static = omp_get_wtime();
         compute_sobel_static();
         dtime_static = omp_get_wtime() - dtime_static;
         std::cout << "Static Method Time: " << dtime_static << " seconds\n";
+    } else if (numaPlacement) {
+        double dtime_numa = omp_get_wtime();
+        compute_sobel_numa();
+        dtime_numa = omp_get_wtime() - dtime_numa;
+        std::cout << "NUMA Method Time: " << dtime_numa << " seconds\n";
+        numa::report_pages("inputImage", image_view(inputImage));
+        numa::report_pages("outputImage", image_view(outputImage));
     } else {
         double dtime_dyn = omp_get_wtime();
         compute_sobel_dynamic();
@@ -177,23 +563,17 @@ int main(int argc, char* argv[]) {
     }
 
     /* ********Start writing output to your file************ */
-    std::ofstream ofile(argv[2]);
-    if (ofile.is_open()) {
-        ofile << "P2" << "\n" << image_width << " " << image_height << "\n" << image_maxShades << "\n";
-        for( int i = 0; i < image_height; ++i) {
-            for( int j = 0; j < image_width; ++j) {
-                ofile << outputImage[i][j] << " ";
-            }
-            ofile << "\n";
-        }
-    } else {
+    perf::Scope write(perf::PHASE_WRITE, -1);
+    if (!write_output(argv[2])) {
         std::cout << "ERROR: Could not open output file " << argv[2] << std::endl;
         return 0;
     }
+    write.end();
 
     int total_thrd = thread_rows.size();
     for (int thrd_i = 0; thrd_i < total_thrd; ++thrd_i)
         std::cout << "Thread " << thread_rows[thrd_i].first << " -> Processing Chunk starting at Row " << thread_rows[thrd_i].second << std::endl;
+    perf::report("pixel", (double)image_height*image_width);
 
     return 0;
 }
\ No newline at end of file
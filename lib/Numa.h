@@ -0,0 +1,134 @@
+/*
+ * NUMA placement shared by the Pthreads and OpenMP Sobel programs
+ * Usage: header only, #include "../lib/Numa.h" and compile as before
+          numa::pin_thread(n);                                     pin the calling thread to the n-th allowed cpu
+          numa::ScopedPin pin(n);                                  the same until pin goes out of scope
+          numa::first_touch(staging, in, out, rowBegin, rowEnd);   place the rows of a thread on its node
+          numa::Block<int> block(in, rowBegin, rowEnd, replicate); its rows and the halo rows around them
+          block.filter<mode>(in, out, r0, r1);
+          numa::report_pages("inputImage", in);                    print on which nodes the pages ended up
+ */
+
+#ifndef NUMA_LIB_H
+#define NUMA_LIB_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "Sobel.h"
+
+namespace numa {
+
+// Pin the calling thread to the thread_num-th cpu it is allowed to run on
+inline bool pin_thread(int thread_num) {
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+    int skip = thread_num % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || skip-- > 0) continue;
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
+        return pthread_setaffinity_np(pthread_self(), sizeof(target), &target) == 0;
+    }
+    return false;
+}
+
+// Pin the calling thread like pin_thread (unless enable is false) for as long as it exists, then give the
+// thread back the cpus it was allowed before. The main thread and pool threads outlive a NUMA run and must
+// not stay pinned.
+class ScopedPin {
+public:
+    explicit ScopedPin(int thread_num, bool enable = true)
+        : saved(enable && pthread_getaffinity_np(pthread_self(), sizeof(mask), &mask) == 0),
+          pinned(saved && pin_thread(thread_num)) {}
+
+    ~ScopedPin() {
+        if (pinned) pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    }
+
+    bool ok() const { return pinned; }
+
+private:
+    cpu_set_t mask;
+    bool saved, pinned;
+};
+
+// Copy rows [rowBegin, rowEnd) out of the packed staging pixels and clear them in out.
+// The calling thread touches these pages first, so they are placed on its node.
+template<typename T>
+void first_touch(const T* staging, const sobel::ImageView& in, const sobel::ImageView& out, int rowBegin, int rowEnd) {
+    for (int x = rowBegin; x < rowEnd; ++x) {
+        std::copy(staging + (size_t)x*in.width, staging + (size_t)(x+1)*in.width, in.row<T>(x));
+        std::fill(out.row<T>(x), out.row<T>(x) + out.width, (T)0);
+    }
+}
+
+// Rows [rowBegin, rowEnd) of one thread and the two rows just outside them, which its neighbours own.
+// Construct it after the neighbours have touched their rows. With replicate the halo rows are copied,
+// so every row the thread reads is on its own node.
+template<typename T>
+class Block {
+public:
+    Block(const sobel::ImageView& in, int rowBegin, int rowEnd, bool replicate) : rowBegin(rowBegin), rowEnd(rowEnd) {
+        top = in.row<const T>(rowBegin > 0 ? rowBegin-1 : 0);
+        bottom = in.row<const T>(rowEnd < in.height ? rowEnd : in.height-1);
+        if (replicate) {
+            halo.assign(top, top + in.width);
+            halo.insert(halo.end(), bottom, bottom + in.width);
+            top = &halo[0];
+            bottom = &halo[in.width];
+        }
+    }
+
+    // Filter rows [r0, r1) of the block, reading the halo rows from the block
+    template<sobel::BorderMode mode>
+    void filter(const sobel::ImageView& in, const sobel::ImageView& out, int r0, int r1) const {
+        for (int x = r0; x < r1; ++x) {
+            if (x == 0 || x == in.height-1) {
+                sobel::sobel_rect<mode, T, T>(in, out, x, x+1, 0, in.width);
+                continue;
+            }
+            sobel::sobel_row<mode>(x == rowBegin ? top : in.row<const T>(x-1), in.row<const T>(x),
+                                   x == rowEnd-1 ? bottom : in.row<const T>(x+1), out.row<T>(x), in.width, 0, in.width);
+        }
+    }
+
+private:
+    int rowBegin, rowEnd;
+    const T* top;
+    const T* bottom;
+    std::vector<T> halo;
+};
+
+// Print on which NUMA node the pages holding the pixels of v live
+inline void report_pages(const char* name, const sobel::ImageView& v) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)v.data & ~(pageSize-1);
+    uintptr_t end = (uintptr_t)(v.row<char>(v.height-1) + v.width*sobel::pixel_size(v.type));
+    std::vector<void*> pages;
+    for (uintptr_t page = begin; page < end; page += pageSize) pages.push_back((void*)page);
+    std::vector<int> status(pages.size(), -1);
+    // move_pages without target nodes only queries where each page is
+    if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), NULL, status.data(), 0) != 0) {
+        std::cout << "Pages of " << name << ": node placement unavailable" << std::endl;
+        return;
+    }
+    std::map<int, int> perNode;
+    for (size_t i = 0; i < status.size(); ++i) ++perNode[status[i]];
+    std::cout << "Pages of " << name << ":";
+    for (std::map<int, int>::iterator it = perNode.begin(); it != perNode.end(); ++it) {
+        if (it->first >= 0) std::cout << " node" << it->first << " " << it->second;
+        else std::cout << " unplaced " << it->second;
+    }
+    std::cout << std::endl;
+}
+
+}
+
+#endif
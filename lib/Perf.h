@@ -0,0 +1,225 @@
+/*
+ * Per-phase, per-thread hardware counters through perf_event_open
+ * Usage: header only, #include "../lib/Perf.h", then run the program with PERF_PHASES=1
+          { perf::Scope scope(perf::PHASE_COMPUTE, thread_num); ... }  counts the calling thread inside the block
+          perf::report("pixel", pixels);                              prints IPC, misses and bytes per pixel per phase
+          Counters the kernel or the machine does not allow are left out, wall time is always measured.
+ */
+
+#ifndef PERF_LIB_H
+#define PERF_LIB_H
+
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf {
+
+// distribute is the time spent sending input to other processes and receiving it, before compute
+enum Phase { PHASE_PARSE, PHASE_DISTRIBUTE, PHASE_COMPUTE, PHASE_REDUCE, PHASE_WRITE, PHASES };
+const char* const phaseNames[PHASES] = {"parse", "distribute", "compute", "reduce", "write"};
+
+enum Event { CYCLES, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, STALLED_CYCLES, EVENTS };
+const char* const eventNames[EVENTS] = {"cycles", "instructions", "LLC misses", "branch misses", "stalled cycles"};
+const uint64_t eventConfigs[EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+                                       PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_STALLED_CYCLES_BACKEND};
+
+// Every LLC miss is taken to bring in one line, which gives the bytes moved from memory
+const int CACHE_LINE = 64;
+
+// Opt-in, so the counters cost nothing unless PERF_PHASES is set
+inline bool enabled() {
+    static bool on = getenv("PERF_PHASES") && strcmp(getenv("PERF_PHASES"), "0");
+    return on;
+}
+
+struct Totals {
+    double seconds = 0;
+    uint64_t value[EVENTS] = {0};
+    bool counted[EVENTS] = {false};
+};
+
+// Totals per (thread, phase), and why counters were missing if they were
+struct Registry {
+    std::mutex mutex;
+    std::map<std::pair<int, int>, Totals> totals;
+    int openErrno[EVENTS] = {0};
+
+    static Registry& get() {
+        static Registry registry;
+        return registry;
+    }
+};
+
+// Counters of the calling thread, opened on first use and kept open until the thread ends.
+// Each event is opened on its own, so one that is not supported does not take the others down.
+class ThreadCounters {
+public:
+    ThreadCounters() {
+        for (int e = 0; e < EVENTS; ++e) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = eventConfigs[e];
+            // user space only, which perf_event_paranoid 2 still allows
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd[e] < 0) {
+                Registry& registry = Registry::get();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                registry.openErrno[e] = errno;
+            }
+        }
+    }
+
+    ~ThreadCounters() {
+        for (int e = 0; e < EVENTS; ++e)
+            if (fd[e] >= 0) close(fd[e]);
+    }
+
+    // Current counts, scaled up when the kernel had to multiplex the counter
+    void read(uint64_t value[EVENTS], bool counted[EVENTS]) {
+        for (int e = 0; e < EVENTS; ++e) {
+            uint64_t data[3];
+            counted[e] = fd[e] >= 0 && ::read(fd[e], data, sizeof(data)) == sizeof(data) && data[2] > 0;
+            value[e] = counted[e] ? (uint64_t)((double)data[0]*data[1]/data[2]) : 0;
+        }
+    }
+
+    static ThreadCounters& get() {
+        static thread_local ThreadCounters counters;
+        return counters;
+    }
+
+private:
+    int fd[EVENTS];
+};
+
+// Counts the calling thread from construction to destruction into phase of thread, -1 is the main thread
+class Scope {
+public:
+    explicit Scope(Phase phase, int thread = 0) : phase(phase), thread(thread), active(enabled()) {
+        if (!active) return;
+        ThreadCounters::get().read(startValue, startCounted);
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~Scope() {
+        end();
+    }
+
+    // Stop counting before the end of the block
+    void end() {
+        if (!active) return;
+        active = false;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t value[EVENTS];
+        bool counted[EVENTS];
+        ThreadCounters::get().read(value, counted);
+        Registry& registry = Registry::get();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        Totals& t = registry.totals[std::make_pair(thread, (int)phase)];
+        t.seconds += seconds;
+        for (int e = 0; e < EVENTS; ++e) {
+            if (!counted[e] || !startCounted[e]) continue;
+            t.value[e] += value[e] - startValue[e];
+            t.counted[e] = true;
+        }
+    }
+
+private:
+    Phase phase;
+    int thread;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+    uint64_t startValue[EVENTS];
+    bool startCounted[EVENTS];
+};
+
+inline void print_totals(std::ostream& os, const Totals& t, const bool available[EVENTS], const char* unit, double units) {
+    for (int e = 0; e < EVENTS; ++e) {
+        if (!available[e]) continue;
+        os << ", " << eventNames[e] << " ";
+        if (t.counted[e]) os << t.value[e];
+        else os << "n/a";
+    }
+    if (t.counted[CYCLES] && t.counted[INSTRUCTIONS] && t.value[CYCLES])
+        os << ", IPC " << (double)t.value[INSTRUCTIONS]/t.value[CYCLES];
+    if (unit && units > 0 && t.counted[LLC_MISSES])
+        os << ", " << (double)t.value[LLC_MISSES]*CACHE_LINE/units << " bytes/" << unit;
+    os << "\n";
+}
+
+inline void print_thread(std::ostream& os, int thread, const char* who) {
+    if (thread < 0) os << " main";
+    else os << " " << who << " " << thread;
+}
+
+// Print every phase summed over threads, then each thread on its own. units is the work this process
+// did in every phase (pixels, words), who names the threads ("Thread", "Process").
+// Counters that could not be opened are left out, so without any of them only wall time is printed.
+inline void report(const char* unit, double units, const char* who = "Thread", std::ostream& os = std::cout) {
+    if (!enabled()) return;
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    typedef std::map<std::pair<int, int>, Totals>::iterator Iterator;
+    bool available[EVENTS];
+    std::map<int, std::string> missing;
+    for (int e = 0; e < EVENTS; ++e) {
+        available[e] = false;
+        for (Iterator it = registry.totals.begin(); it != registry.totals.end(); ++it)
+            available[e] = available[e] || it->second.counted[e];
+        if (!available[e] && registry.openErrno[e]) {
+            std::string& names = missing[registry.openErrno[e]];
+            names += (names.empty() ? "" : ", ") + std::string(eventNames[e]);
+        }
+    }
+    for (std::map<int, std::string>::iterator it = missing.begin(); it != missing.end(); ++it)
+        os << "Perf: no counters for " << it->second << " (" << strerror(it->first) << ")\n";
+    for (int phase = 0; phase < PHASES; ++phase) {
+        Totals sum;
+        int threads = 0;
+        Iterator only = registry.totals.end();
+        for (Iterator it = registry.totals.begin(); it != registry.totals.end(); ++it) {
+            if (it->first.second != phase) continue;
+            ++threads;
+            only = it;
+            sum.seconds += it->second.seconds;
+            for (int e = 0; e < EVENTS; ++e) {
+                sum.value[e] += it->second.value[e];
+                sum.counted[e] = sum.counted[e] || it->second.counted[e];
+            }
+        }
+        if (threads == 0) continue;
+        // a phase run by one thread gets a single line with its name
+        os << "Perf " << phaseNames[phase];
+        if (threads == 1) print_thread(os, only->first.first, who);
+        os << ": " << sum.seconds << " s";
+        print_totals(os, sum, available, unit, units);
+        if (threads == 1) continue;
+        for (Iterator it = registry.totals.begin(); it != registry.totals.end(); ++it) {
+            if (it->first.second != phase) continue;
+            os << "Perf " << phaseNames[phase];
+            print_thread(os, it->first.first, who);
+            os << ": " << it->second.seconds << " s";
+            print_totals(os, it->second, available, NULL, 0);
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * PGM output shared by the Pthreads, OpenMPI and OpenMP Sobel programs
+ * Usage: header only, #include "../lib/Pgm.h" and compile as before
+          std::string out(pgm::formatted_size(width, rows, binary), 0);
+          out.resize(pgm::format_rows(view, r0, r1, binary, &out[0]) - &out[0]);
+          std::string header = pgm::pgm_header(width, height, maxShades, binary);
+          pgm::write_file(filename, iov, count);                 header and rows with as few writev calls as possible
+ */
+
+#ifndef PGM_LIB_H
+#define PGM_LIB_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "Sobel.h"
+
+namespace pgm {
+
+// Longest header pgm_header writes: magic, two sizes and the maximum shade
+const int HEADER_MAX = 64;
+
+// Pixels are clamped to [0, 255], so at most three digits are written
+inline char* pixel_to_ascii(int v, char* p) {
+    if (v >= 100) {
+        *p++ = '0' + v/100;
+        v %= 100;
+        *p++ = '0' + v/10;
+    } else if (v >= 10) {
+        *p++ = '0' + v/10;
+    }
+    *p++ = '0' + v%10;
+    return p;
+}
+
+// Bytes needed to format rows of width pixels as P2 text or P5 bytes
+inline size_t formatted_size(int width, int rows, bool binary) {
+    return (size_t)rows*(binary ? width : width*4+1);
+}
+
+template<typename T>
+char* format_rows(const sobel::ImageView& v, int r0, int r1, bool binary, char* p) {
+    for (int x = r0; x < r1; ++x) {
+        const T* row = v.row<const T>(x);
+        if (binary) {
+            for (int y = 0; y < v.width; ++y) *p++ = (char)row[y];
+            continue;
+        }
+        for (int y = 0; y < v.width; ++y) {
+            p = pixel_to_ascii(row[y], p);
+            *p++ = ' ';
+        }
+        *p++ = '\n';
+    }
+    return p;
+}
+
+// Format rows [r0, r1) of v into p, returns the end of the written bytes
+inline char* format_rows(const sobel::ImageView& v, int r0, int r1, bool binary, char* p) {
+    switch (v.type) {
+    case sobel::PIXEL_U8: return format_rows<uint8_t>(v, r0, r1, binary, p);
+    case sobel::PIXEL_U16: return format_rows<uint16_t>(v, r0, r1, binary, p);
+    default: return format_rows<int>(v, r0, r1, binary, p);
+    }
+}
+
+// Write the header into p, which has room for HEADER_MAX bytes, and return its length.
+// P5 stores one byte per pixel, so its maximum shade is at most 255.
+inline int pgm_header(char* p, int width, int height, int maxShades, bool binary) {
+    return snprintf(p, HEADER_MAX, "%s\n%d %d\n%d\n", binary ? "P5" : "P2", width, height,
+                    binary ? std::min(maxShades, 255) : maxShades);
+}
+
+inline std::string pgm_header(int width, int height, int maxShades, bool binary) {
+    char header[HEADER_MAX];
+    return std::string(header, pgm_header(header, width, height, maxShades, binary));
+}
+
+// Write all count buffers to fd with as few writev calls as possible, iov is advanced in place
+inline bool writev_all(int fd, iovec* iov, size_t count) {
+    size_t first = 0;
+    while (first < count) {
+        int cnt = std::min<size_t>(count - first, IOV_MAX);
+        ssize_t written = writev(fd, iov + first, cnt);
+        if (written < 0) return false;
+        // skip fully written buffers and advance into a partially written one
+        while (first < count && (size_t)written >= iov[first].iov_len) written -= iov[first++].iov_len;
+        if (first < count) {
+            iov[first].iov_base = (char*)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Create or truncate filename and write the buffers into it
+inline bool write_file(const char* filename, iovec* iov, size_t count) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool written = writev_all(fd, iov, count);
+    return close(fd) == 0 && written;
+}
+
+}
+
+#endif
@@ -0,0 +1,523 @@
+/*
+ * In-memory Sobel filter shared by the Pthreads, OpenMPI and OpenMP programs
+ * Usage: header only, #include "../lib/Sobel.h" and compile as before
+          include mpi.h first to get the MPI executor, compile with -fopenmp to get the OpenMP executor
+
+          sobel::ImageView in = sobel::view(pixels, width, height, strideInBytes);
+          sobel::ImageView out = sobel::view(result, width, height);
+          sobel::ThreadPool pool;
+          sobel::filter(in, out, pool, sobel::BORDER_REPLICATE);
+ */
+
+#ifndef SOBEL_LIB_H
+#define SOBEL_LIB_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace sobel {
+
+// Border modes: zero (border pixels are 0), replicate (a|abc|c), reflect (b|abc|b) and wrap (c|abc|a)
+enum BorderMode { BORDER_ZERO, BORDER_REPLICATE, BORDER_REFLECT, BORDER_WRAP };
+
+// Maps an index one step outside [0, n) back into the image, -1 when the mode has no source pixel
+template<BorderMode mode> struct Border;
+template<> struct Border<BORDER_ZERO> {
+    static int index(int i, int n) { return i < 0 || i >= n ? -1 : i; }
+};
+template<> struct Border<BORDER_REPLICATE> {
+    static int index(int i, int n) { return i < 0 ? 0 : i >= n ? n-1 : i; }
+};
+template<> struct Border<BORDER_REFLECT> {
+    static int index(int i, int n) { return n == 1 ? 0 : i < 0 ? -i : i >= n ? 2*n-2-i : i; }
+};
+template<> struct Border<BORDER_WRAP> {
+    static int index(int i, int n) { return i < 0 ? i+n : i >= n ? i-n : i; }
+};
+
+// 3x3 Sobel masks
+const int maskX[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+const int maskY[3][3] = {{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}};
+
+// Rows handed to an executor at a time
+const int TASK_ROWS = 16;
+
+enum PixelType { PIXEL_U8, PIXEL_U16, PIXEL_I32 };
+
+template<typename T> struct PixelTraits;
+template<> struct PixelTraits<uint8_t> { static const PixelType type = PIXEL_U8; };
+template<> struct PixelTraits<uint16_t> { static const PixelType type = PIXEL_U16; };
+template<> struct PixelTraits<int> { static const PixelType type = PIXEL_I32; };
+
+inline size_t pixel_size(PixelType type) {
+    return type == PIXEL_U8 ? 1 : type == PIXEL_U16 ? 2 : 4;
+}
+
+// Borrowed pixels: height rows of width pixels, stride bytes apart. Nothing is copied, the caller keeps the memory.
+struct ImageView {
+    void* data;
+    int width, height;
+    ptrdiff_t stride;
+    PixelType type;
+
+    template<typename T> T* row(int x) const { return (T*)((char*)data + x*stride); }
+};
+
+// View of width x height pixels of type T, stride 0 means the rows are packed
+template<typename T>
+ImageView view(T* data, int width, int height, ptrdiff_t stride = 0) {
+    typedef typename std::remove_const<T>::type Pixel;
+    ImageView v = {(void*)data, width, height, stride ? stride : (ptrdiff_t)(width*sizeof(T)), PixelTraits<Pixel>::type};
+    return v;
+}
+
+// Output has to match the input size and can not share its pixels, rows are read after others were written
+inline bool valid(const ImageView& in, const ImageView& out) {
+    return in.data && out.data && in.data != out.data && in.width > 0 && in.height > 0
+        && in.width == out.width && in.height == out.height;
+}
+
+// ***************** Kernels *********************
+
+// Gradient of pixels [0, n) of row, reading one pixel to either side. Branch-free, so it vectorizes.
+template<typename In, typename Out>
+void gradient_span(const In* above, const In* row, const In* below, Out* out, int n) {
+    const In* rows[3] = {above, row, below};
+    for (int y = 0; y < n; ++y) {
+        int sumx = 0, sumy = 0;
+        for (int i = 0; i <= 2; ++i) {
+            for (int j = -1; j <= 1; ++j) {
+                sumx += rows[i][y+j] * maskX[i][j+1];
+                sumy += rows[i][y+j] * maskY[i][j+1];
+            }
+        }
+        int sum = abs(sumx) + abs(sumy);
+        out[y] = (Out)(sum > 255 ? 255 : sum);
+    }
+}
+
+// Gradient of a pixel in a border row or column, neighbours are fetched through the border mode
+template<BorderMode mode, typename In>
+int border_pixel(const In* rows[3], int y, int width) {
+    if (mode == BORDER_ZERO) return 0;
+    int sumx = 0, sumy = 0;
+    for (int i = 0; i <= 2; ++i) {
+        for (int j = -1; j <= 1; ++j) {
+            int v = rows[i][Border<mode>::index(y+j, width)];
+            sumx += v * maskX[i][j+1];
+            sumy += v * maskY[i][j+1];
+        }
+    }
+    int sum = abs(sumx) + abs(sumy);
+    return sum > 255 ? 255 : sum;
+}
+
+// Columns [c0, c1) of a row from its neighbour rows: the branch-free interior, then the two border columns
+template<BorderMode mode, typename In, typename Out>
+void sobel_row(const In* above, const In* row, const In* below, Out* out, int width, int c0, int c1) {
+    int begin = std::max(c0, 1), end = std::min(c1, width-1);
+    if (begin < end) gradient_span(above + begin, row + begin, below + begin, out + begin, end - begin);
+    const In* rows[3] = {above, row, below};
+    if (c0 == 0) out[0] = (Out)border_pixel<mode>(rows, 0, width);
+    if (c1 == width) out[width-1] = (Out)border_pixel<mode>(rows, width-1, width);
+}
+
+// Columns [c0, c1) of the first or last image row, every pixel in it is a border pixel
+template<BorderMode mode, typename In, typename Out>
+void sobel_border_row(const In* above, const In* row, const In* below, Out* out, int width, int c0, int c1) {
+    const In* rows[3] = {above, row, below};
+    for (int y = c0; y < c1; ++y) out[y] = (Out)border_pixel<mode>(rows, y, width);
+}
+
+// Rows of a view by image row number, first is the image row stored at data
+template<typename T>
+struct ViewRows {
+    char* data;
+    ptrdiff_t stride;
+    int first;
+
+    ViewRows(const ImageView& v, int first = 0) : data((char*)v.data), stride(v.stride), first(first) {}
+    T* operator()(int x) const { return (T*)(data + (x-first)*stride); }
+};
+
+// Filter rows [r0, r1) and columns [c0, c1) of an image of width x height pixels.
+// in(x) and out(x) return image row x, in is only asked for rows next to [r0, r1) or their border mode sources.
+template<BorderMode mode, typename In, typename Out, typename InRows, typename OutRows>
+void sobel_rect(const InRows& in, const OutRows& out, int width, int height, int r0, int r1, int c0, int c1) {
+    for (int x = r0; x < r1; ++x) {
+        if (x > 0 && x < height-1) {
+            sobel_row<mode>(in(x-1), in(x), in(x+1), out(x), width, c0, c1);
+        } else if (mode == BORDER_ZERO) {
+            std::fill(out(x) + c0, out(x) + c1, (Out)0);
+        } else {
+            sobel_border_row<mode>(in(Border<mode>::index(x-1, height)), in(x), in(Border<mode>::index(x+1, height)),
+                                   out(x), width, c0, c1);
+        }
+    }
+}
+
+template<BorderMode mode, typename In, typename Out>
+void sobel_rect(const ImageView& in, const ImageView& out, int r0, int r1, int c0, int c1) {
+    sobel_rect<mode, In, Out>(ViewRows<const In>(in), ViewRows<Out>(out), in.width, in.height, r0, r1, c0, c1);
+}
+
+// Calls job.run<mode, In, Out>() with the template arguments picked at run time
+template<BorderMode mode, typename In, typename Job>
+void dispatch_out(PixelType out, Job& job) {
+    switch (out) {
+    case PIXEL_U8: job.template run<mode, In, uint8_t>(); break;
+    case PIXEL_U16: job.template run<mode, In, uint16_t>(); break;
+    default: job.template run<mode, In, int>(); break;
+    }
+}
+
+template<BorderMode mode, typename Job>
+void dispatch_in(PixelType in, PixelType out, Job& job) {
+    switch (in) {
+    case PIXEL_U8: dispatch_out<mode, uint8_t>(out, job); break;
+    case PIXEL_U16: dispatch_out<mode, uint16_t>(out, job); break;
+    default: dispatch_out<mode, int>(out, job); break;
+    }
+}
+
+template<typename Job>
+void dispatch(PixelType in, PixelType out, BorderMode mode, Job& job) {
+    switch (mode) {
+    case BORDER_REPLICATE: dispatch_in<BORDER_REPLICATE>(in, out, job); break;
+    case BORDER_REFLECT: dispatch_in<BORDER_REFLECT>(in, out, job); break;
+    case BORDER_WRAP: dispatch_in<BORDER_WRAP>(in, out, job); break;
+    default: dispatch_in<BORDER_ZERO>(in, out, job); break;
+    }
+}
+
+struct RectJob {
+    const ImageView &in, &out;
+    int r0, r1, c0, c1;
+
+    template<BorderMode mode, typename In, typename Out> void run() {
+        sobel_rect<mode, In, Out>(in, out, r0, r1, c0, c1);
+    }
+};
+
+// Filter rows [r0, r1) and columns [c0, c1) of in into out
+inline void filter_rect(const ImageView& in, const ImageView& out, int r0, int r1, int c0, int c1, BorderMode mode = BORDER_ZERO) {
+    RectJob job = {in, out, r0, r1, c0, c1};
+    dispatch(in.type, out.type, mode, job);
+}
+
+// ***************** Executors *********************
+
+// Filter on the calling thread
+struct Serial {};
+
+inline bool filter(const ImageView& in, const ImageView& out, Serial, BorderMode mode = BORDER_ZERO) {
+    if (!valid(in, out)) return false;
+    filter_rect(in, out, 0, in.height, 0, in.width, mode);
+    return true;
+}
+
+inline bool filter(const ImageView& in, const ImageView& out, BorderMode mode = BORDER_ZERO) {
+    return filter(in, out, Serial(), mode);
+}
+
+// Threads that stay alive between images, so a service does not pay for thread creation per call.
+// The calling thread works along, and one run happens at a time.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads = 0) {
+        if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 1; i < threads; ++i) workers.emplace_back(&ThreadPool::work, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    }
+
+    int size() const { return workers.size() + 1; }
+
+    // Run task(0) ... task(tasks-1) and return when all of them are done
+    void run(int tasks, const std::function<void(int)>& task) {
+        start(tasks, task, false);
+    }
+
+    // Run task(i) on the i-th thread of the pool, the caller being thread 0, so every call
+    // runs concurrently with the others and may pin its thread or wait on a barrier
+    void run_each(const std::function<void(int)>& task) {
+        start(size(), task, true);
+    }
+
+private:
+    void start(int tasks, const std::function<void(int)>& task, bool perThread) {
+        std::lock_guard<std::mutex> running(runMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            jobTasks = tasks;
+            each = perThread;
+            next = 0;
+            active = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        claim(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        job = NULL;
+    }
+
+    void claim(int thread) {
+        if (each) {
+            (*job)(thread);
+            return;
+        }
+        for (int i = next++; i < jobTasks; i = next++) (*job)(i);
+    }
+
+    void work(int thread) {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+            lock.unlock();
+            claim(thread);
+            lock.lock();
+            if (--active == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex, runMutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)>* job = NULL;
+    int jobTasks = 0, active = 0;
+    bool each = false;
+    std::atomic<int> next{0};
+    unsigned generation = 0;
+    bool stop = false;
+};
+
+inline bool filter(const ImageView& in, const ImageView& out, ThreadPool& pool, BorderMode mode = BORDER_ZERO) {
+    if (!valid(in, out)) return false;
+    int tasks = (in.height + TASK_ROWS - 1)/TASK_ROWS;
+    pool.run(tasks, [&](int i) {
+        filter_rect(in, out, i*TASK_ROWS, std::min((i+1)*TASK_ROWS, in.height), 0, in.width, mode);
+    });
+    return true;
+}
+
+#ifdef _OPENMP
+// Filter blocks of TASK_ROWS rows in an OpenMP parallel loop, on OMP_NUM_THREADS threads unless given
+struct OpenMP {
+    int threads;
+    explicit OpenMP(int threads = 0) : threads(threads) {}
+};
+
+inline bool filter(const ImageView& in, const ImageView& out, const OpenMP& omp, BorderMode mode = BORDER_ZERO) {
+    if (!valid(in, out)) return false;
+    int tasks = (in.height + TASK_ROWS - 1)/TASK_ROWS;
+    int threads = omp.threads > 0 ? omp.threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int i = 0; i < tasks; ++i)
+        filter_rect(in, out, i*TASK_ROWS, std::min((i+1)*TASK_ROWS, in.height), 0, in.width, mode);
+    return true;
+}
+#endif
+
+#ifdef MPI_VERSION
+// Filter horizontal strips on the processes of a communicator. The image only has to exist on root.
+struct Mpi {
+    MPI_Comm comm;
+    int root;
+    explicit Mpi(MPI_Comm comm = MPI_COMM_WORLD, int root = 0) : comm(comm), root(root) {}
+};
+
+inline MPI_Datatype mpi_pixel(PixelType type) {
+    return type == PIXEL_U8 ? MPI_UNSIGNED_CHAR : type == PIXEL_U16 ? MPI_UNSIGNED_SHORT : MPI_INT;
+}
+
+// Border<mode>::index for a mode known at run time
+inline int border_index(BorderMode mode, int i, int n) {
+    switch (mode) {
+    case BORDER_REPLICATE: return Border<BORDER_REPLICATE>::index(i, n);
+    case BORDER_REFLECT: return Border<BORDER_REFLECT>::index(i, n);
+    case BORDER_WRAP: return Border<BORDER_WRAP>::index(i, n);
+    default: return Border<BORDER_ZERO>::index(i, n);
+    }
+}
+
+// Rows of a received strip: rows [begin, end) and the rows just outside them are stored in order,
+// other rows are border mode sources of the image border rows and live in the halo rows
+template<typename T>
+struct StripRows {
+    char* data;
+    ptrdiff_t stride;
+    int begin, end, top;
+
+    T* operator()(int x) const {
+        int local = x >= begin-1 && x <= end ? x-begin+1 : x == top ? 0 : end-begin+1;
+        return (T*)(data + local*stride);
+    }
+};
+
+struct StripJob {
+    std::vector<char> &strip, &result;
+    int width, height, begin, end, top;
+
+    template<BorderMode mode, typename In, typename Out> void run() {
+        StripRows<const In> in = {strip.data(), (ptrdiff_t)(width*sizeof(In)), begin, end, top};
+        ViewRows<Out> out(view((Out*)result.data(), width, end-begin), begin);
+        sobel_rect<mode, In, Out>(in, out, width, height, begin, end, 0, width);
+    }
+};
+
+// Rows x..x+rows-1 of a view as one datatype, so root sends and receives them without packing
+inline MPI_Datatype mpi_rows(const ImageView& v, PixelType type, int rows) {
+    MPI_Datatype datatype;
+    MPI_Type_create_hvector(rows, v.width, v.stride, mpi_pixel(type), &datatype);
+    MPI_Type_commit(&datatype);
+    return datatype;
+}
+
+// Rows [begin, end) of process p out of size, the strips differ by at most one row
+inline void strip_range(int p, int size, int height, int& begin, int& end) {
+    begin = (long long)height*p/size;
+    end = (long long)height*(p+1)/size;
+}
+
+// The filtered rows [begin, end) of a width x height image that one process holds, packed pixels of type.
+// Between receive_strip and filter_strip, input holds the received rows begin-1..end in inType.
+struct Strip {
+    int width, height, begin, end;
+    PixelType type;
+    std::vector<char> pixels;
+    PixelType inType;
+    BorderMode mode;
+    int top;
+    std::vector<char> input;
+
+    Strip() : width(0), height(0), begin(0), end(0), type(PIXEL_I32), inType(PIXEL_I32), mode(BORDER_ZERO), top(-1) {}
+
+    template<typename T> T* row(int x) { return (T*)(pixels.data() + (x-begin)*width*pixel_size(type)); }
+};
+
+// Every process of the communicator calls this and receives its own strip of in, in and outType are
+// only read on root. Root sends each strip with the rows just outside it, mapped through the border mode.
+inline bool receive_strip(const ImageView& in, PixelType outType, Strip& strip, const Mpi& mpi, BorderMode mode = BORDER_ZERO) {
+    int rank, size;
+    MPI_Comm_rank(mpi.comm, &rank);
+    MPI_Comm_size(mpi.comm, &size);
+    int info[6] = {in.width, in.height, in.type, outType, mode, rank == mpi.root && in.data && in.width > 0 && in.height > 0};
+    MPI_Bcast(info, 6, MPI_INT, mpi.root, mpi.comm);
+    if (!info[5]) return false;
+    int width = info[0], height = info[1];
+    PixelType inType = (PixelType)info[2];
+    mode = (BorderMode)info[4];
+
+    std::vector<MPI_Request> requests;
+    if (rank == mpi.root) {
+        for (int p = 0; p < size; ++p) {
+            int b, e;
+            strip_range(p, size, height, b, e);
+            if (b == e) continue;
+            int top = border_index(mode, b-1, height), bottom = border_index(mode, e, height);
+            MPI_Datatype body = mpi_rows(in, inType, e-b), line = mpi_rows(in, inType, 1);
+            requests.resize(requests.size() + 3, MPI_REQUEST_NULL);
+            MPI_Request* r = &requests[requests.size() - 3];
+            if (top >= 0) MPI_Isend(in.row<char>(top), 1, line, p, 0, mpi.comm, &r[0]);
+            MPI_Isend(in.row<char>(b), 1, body, p, 1, mpi.comm, &r[1]);
+            if (bottom >= 0) MPI_Isend(in.row<char>(bottom), 1, line, p, 2, mpi.comm, &r[2]);
+            MPI_Type_free(&body);
+            MPI_Type_free(&line);
+        }
+    }
+
+    int begin, end;
+    strip_range(rank, size, height, begin, end);
+    size_t inRow = width*pixel_size(inType);
+    strip.width = width;
+    strip.height = height;
+    strip.begin = begin;
+    strip.end = end;
+    strip.type = (PixelType)info[3];
+    strip.inType = inType;
+    strip.mode = mode;
+    strip.top = border_index(mode, begin-1, height);
+    strip.input.assign((end-begin+2)*inRow, 0);
+    strip.pixels.clear();
+    if (begin < end) {
+        int bottom = border_index(mode, end, height);
+        MPI_Datatype pixel = mpi_pixel(inType);
+        if (strip.top >= 0) MPI_Recv(&strip.input[0], width, pixel, mpi.root, 0, mpi.comm, MPI_STATUS_IGNORE);
+        MPI_Recv(&strip.input[inRow], (end-begin)*width, pixel, mpi.root, 1, mpi.comm, MPI_STATUS_IGNORE);
+        if (bottom >= 0) MPI_Recv(&strip.input[(end-begin+1)*inRow], width, pixel, mpi.root, 2, mpi.comm, MPI_STATUS_IGNORE);
+    }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    return true;
+}
+
+// Filter the rows received by receive_strip into pixels, without any communication
+inline void filter_strip(Strip& strip) {
+    strip.pixels.assign((strip.end-strip.begin)*strip.width*pixel_size(strip.type), 0);
+    if (strip.begin < strip.end) {
+        StripJob job = {strip.input, strip.pixels, strip.width, strip.height, strip.begin, strip.end, strip.top};
+        dispatch(strip.inType, strip.type, strip.mode, job);
+    }
+    std::vector<char>().swap(strip.input);
+}
+
+// receive_strip and filter_strip in one call, so the caller can use the strips without gathering the image
+inline bool filter_strip(const ImageView& in, PixelType outType, Strip& strip, const Mpi& mpi, BorderMode mode = BORDER_ZERO) {
+    if (!receive_strip(in, outType, strip, mpi, mode)) return false;
+    filter_strip(strip);
+    return true;
+}
+
+// Every process of the communicator calls this, in and out are only read on root
+inline bool filter(const ImageView& in, const ImageView& out, const Mpi& mpi, BorderMode mode = BORDER_ZERO) {
+    int rank, size;
+    MPI_Comm_rank(mpi.comm, &rank);
+    MPI_Comm_size(mpi.comm, &size);
+    // an invalid pair on root makes every process return false
+    Strip strip;
+    if (!filter_strip(rank == mpi.root && !valid(in, out) ? ImageView() : in, out.type, strip, mpi, mode)) return false;
+
+    MPI_Request sent = MPI_REQUEST_NULL;
+    if (strip.begin < strip.end)
+        MPI_Isend(strip.pixels.data(), (strip.end-strip.begin)*strip.width, mpi_pixel(strip.type), mpi.root, 3, mpi.comm, &sent);
+    if (rank == mpi.root) {
+        for (int p = 0; p < size; ++p) {
+            int b, e;
+            strip_range(p, size, strip.height, b, e);
+            if (b == e) continue;
+            MPI_Datatype body = mpi_rows(out, strip.type, e-b);
+            MPI_Recv(out.row<char>(b), 1, body, p, 3, mpi.comm, MPI_STATUS_IGNORE);
+            MPI_Type_free(&body);
+        }
+    }
+    MPI_Wait(&sent, MPI_STATUS_IGNORE);
+    return true;
+}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Dirty tiles shared by the incremental modes of the Pthreads and OpenMP Sobel programs
+ * Usage: header only, #include "../lib/Tiles.h" and compile as before
+          tiles::Grid grid(width, height, mode);                       every tile starts out dirty
+          grid.dirty[ty*grid.cols + tx] = grid.hash<int>(in, ty, tx) != previousHash;
+          if (grid.needs_work(ty, tx)) grid.recompute<mode, int, int>(in, out, ty, tx);
+ */
+
+#ifndef TILES_LIB_H
+#define TILES_LIB_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "Sobel.h"
+
+namespace tiles {
+
+const int TILE = 32;
+
+// Eight independent hash lanes, one vector register wide, so the compiler turns this into SIMD at -O3
+template<typename T>
+inline void mix_lanes(uint32_t lanes[8], const T* v) {
+    for (int l = 0; l < 8; ++l) lanes[l] = (lanes[l] ^ (uint32_t)v[l]) * 0x9E3779B1u;
+}
+
+// Hash of rows [r0, r1) and columns [c0, c1) of v
+template<typename T>
+uint64_t hash_rect(const sobel::ImageView& v, int r0, int r1, int c0, int c1) {
+    uint32_t lanes[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (int x = r0; x < r1; ++x) {
+        const T* row = v.row<const T>(x);
+        int y = c0;
+        for (; y + 8 <= c1; y += 8) mix_lanes(lanes, row + y);
+        // tiles on the right edge are narrower, pad their rows with zeros
+        if (y < c1) {
+            T tail[8] = {0};
+            std::copy(row + y, row + c1, tail);
+            mix_lanes(lanes, tail);
+        }
+    }
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int l = 0; l < 8; ++l) hash = (hash ^ lanes[l]) * 0x100000001B3ULL;
+    return hash;
+}
+
+// TILE x TILE tiles of a width x height image and which of them changed.
+// Only dirty tiles and the 1-pixel strips of their neighbours have to be filtered again.
+struct Grid {
+    int width, height, rows, cols;
+    bool wrap;
+    std::vector<char> dirty;
+
+    Grid() : width(0), height(0), rows(0), cols(0), wrap(false) {}
+    Grid(int width, int height, sobel::BorderMode mode)
+        : width(width), height(height), rows((height + TILE - 1)/TILE), cols((width + TILE - 1)/TILE),
+          wrap(mode == sobel::BORDER_WRAP), dirty(rows*cols, 1) {}
+
+    int size() const { return rows*cols; }
+
+    // Rows [r0, r1) and columns [c0, c1) of tile (ty, tx)
+    void bounds(int ty, int tx, int& r0, int& r1, int& c0, int& c1) const {
+        r0 = ty*TILE;
+        r1 = std::min(r0+TILE, height);
+        c0 = tx*TILE;
+        c1 = std::min(c0+TILE, width);
+    }
+
+    template<typename T>
+    uint64_t hash(const sobel::ImageView& v, int ty, int tx) const {
+        int r0, r1, c0, c1;
+        bounds(ty, tx, r0, r1, c0, c1);
+        return hash_rect<T>(v, r0, r1, c0, c1);
+    }
+
+    // Tiles outside the image are never dirty, except that wrapping borders read the opposite side
+    bool is_dirty(int ty, int tx) const {
+        if (wrap) {
+            ty = (ty + rows) % rows;
+            tx = (tx + cols) % cols;
+        }
+        if (ty < 0 || ty >= rows || tx < 0 || tx >= cols) return false;
+        return dirty[ty*cols + tx];
+    }
+
+    bool needs_work(int ty, int tx) const {
+        for (int dy = -1; dy <= 1; ++dy)
+            for (int dx = -1; dx <= 1; ++dx)
+                if (is_dirty(ty+dy, tx+dx)) return true;
+        return false;
+    }
+
+    // Filter a dirty tile, or only the outermost pixels of a clean tile that face dirty neighbours,
+    // and return the pixels filtered. Each output pixel belongs to exactly one tile, so tiles can be
+    // recomputed concurrently.
+    template<sobel::BorderMode mode, typename In, typename Out>
+    long recompute(const sobel::ImageView& in, const sobel::ImageView& out, int ty, int tx) const {
+        int r0, r1, c0, c1;
+        bounds(ty, tx, r0, r1, c0, c1);
+        if (is_dirty(ty, tx)) {
+            sobel::sobel_rect<mode, In, Out>(in, out, r0, r1, c0, c1);
+            return (long)(r1-r0)*(c1-c0);
+        }
+        long pixels = 0;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                if ((!dy && !dx) || !is_dirty(ty+dy, tx+dx)) continue;
+                int rb = dy > 0 ? r1-1 : r0, re = dy < 0 ? r0+1 : r1;
+                int cb = dx > 0 ? c1-1 : c0, ce = dx < 0 ? c0+1 : c1;
+                sobel::sobel_rect<mode, In, Out>(in, out, rb, re, cb, ce);
+                pixels += (long)(re-rb)*(ce-cb);
+            }
+        }
+        return pixels;
+    }
+};
+
+}
+
+#endif